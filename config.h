@@ -13,15 +13,144 @@
 
 #define XSTACK_DATAGRAM_SIZE_MAX    4096
 
+/**
+ * Default size of a socket ring in bytes.
+ * Each socket has an ingress and an egress ring of this size unless the
+ * socket sets its own ring_size. Must be a power of two and fit at least two
+ * maximum size datagrams.
+ */
 #define XSTACK_DATAGRAM_BUF_SIZE    16384
 
+/**
+ * Max number of datagrams taken from a socket egress queue at once.
+ */
+#define XSTACK_SOCK_EGRESS_BURST    16
+
+/**
+ * Number of times a socket queue is polled before the consumer parks itself
+ * and sleeps on the doorbell.
+ */
+#define XSTACK_SOCK_SPIN_COUNT      1000
+
 /**
  * Periodic IP event tick.
  * How often should periodic tasks run.
- * This is handled by IP but it's meant to be more generic.
+ * The periodic tasks are run by a timer, finer grained timeouts should use
+ * their own timers (timer.h).
  */
 #define XSTACK_PERIODIC_EVENT_SEC   10
 
+/**
+ * Ether Configuration.
+ * @{
+ */
+
+/**
+ * Default ether driver.
+ * + "packet" = AF_PACKET socket
+ * + "xdp" = AF_XDP socket
+ */
+#define XSTACK_ETHER_DRIVER         "packet"
+
+/**
+ * Compute the FCS of transmitted frames in software.
+ * Linux appends the FCS in the driver or NIC, so a software FCS is only
+ * needed if the link passes frames through as is.
+ */
+#define XSTACK_ETHER_SW_FCS         0
+
+/**
+ * Use a memory-mapped TPACKET_V3 receive ring by default.
+ * + 0 = Receive one frame per recvfrom() call
+ * + 1 = Walk frames in place in a PACKET_RX_RING
+ * Can be overridden at runtime with the rx_ring driver option.
+ */
+#define XSTACK_ETHER_RX_RING        1
+
+/**
+ * RX ring block size in bytes.
+ * Must be a multiple of the page size.
+ */
+#define XSTACK_ETHER_RX_BLOCK_SIZE  (1 << 18)
+
+/**
+ * Number of blocks in the RX ring.
+ */
+#define XSTACK_ETHER_RX_BLOCK_NR    64
+
+/**
+ * RX ring frame size in bytes.
+ */
+#define XSTACK_ETHER_RX_FRAME_SIZE  2048
+
+/**
+ * RX ring block retire timeout [ms].
+ * A partially filled block is handed over to the user after this timeout.
+ */
+#define XSTACK_ETHER_RX_BLOCK_TMO   4
+
+/**
+ * Max number of frames received in a single burst.
+ * The ingress thread processes a whole burst before flushing the replies
+ * and checking the timers.
+ */
+#define XSTACK_ETHER_RX_BURST       32
+
+/**
+ * Trust the checksum status reported by the kernel for received frames.
+ * Frames that were verified by the NIC or the kernel skip the IP header
+ * checksum validation. Can be overridden with the csum_trust driver
+ * option.
+ */
+#define XSTACK_ETHER_CSUM_TRUST     0
+
+/**
+ * Use a memory-mapped PACKET_TX_RING by default.
+ * + 0 = Transmit one frame per sendto() call
+ * + 1 = Build frames in place in a PACKET_TX_RING
+ * Can be overridden at runtime with the tx_ring driver option.
+ */
+#define XSTACK_ETHER_TX_RING        1
+
+/**
+ * TX ring frame slot size in bytes.
+ */
+#define XSTACK_ETHER_TX_FRAME_SIZE  2048
+
+/**
+ * Number of frame slots in the TX ring.
+ */
+#define XSTACK_ETHER_TX_FRAME_NR    256
+
+/**
+ * Max number of frames queued before the kernel is kicked even if the queue
+ * wasn't explicitly flushed.
+ * Without a TX ring this is the number of frames sent with one sendmmsg().
+ */
+#define XSTACK_ETHER_TX_BATCH       32
+
+/**
+ * Number of frames in the AF_XDP UMEM.
+ * Half of the frames are used for RX and half for TX.
+ */
+#define XSTACK_ETHER_XDP_FRAME_NR   4096
+
+/**
+ * AF_XDP UMEM frame size in bytes.
+ * Must be a power of two between 2048 and the page size.
+ */
+#define XSTACK_ETHER_XDP_FRAME_SIZE 2048
+
+/**
+ * Number of descriptors in each of the AF_XDP rings.
+ * Must be a power of two.
+ */
+#define XSTACK_ETHER_XDP_RING_SIZE  2048
+
+/**
+ * @}
+ */
+
 /**
  * ARP Configuration.
  * @{
@@ -29,13 +158,28 @@
 
 /**
  * ARP Cache size.
- * The size of ARP cache in entries.
- * If ARP runs out of slots it will free the oldest validdynamic entry in
- * the cache; if all entries all static and thus there is no more empty
- * slots left the ARP insert will fail.
+ * The maximum number of entries in the ARP cache. The cache grows on demand
+ * up to this size, after that ARP will evict a dynamic entry that hasn't been
+ * used recently; if all entries are static the ARP insert will fail.
  */
 #define XSTACK_ARP_CACHE_SIZE       50
 
+/**
+ * ARP request retransmission timeout [ms].
+ * The timeout is doubled after each unanswered request.
+ */
+#define XSTACK_ARP_RETRANS_MS       250
+
+/**
+ * Max number of ARP requests sent for a single address resolution.
+ */
+#define XSTACK_ARP_REQUEST_MAX      5
+
+/**
+ * Max rate of ARP requests sent for all destinations [requests/s].
+ */
+#define XSTACK_ARP_REQUEST_RATE     100
+
 /**
  * @}
  */
@@ -45,17 +189,51 @@
  * IP Configuration.
  */
 
-/**
- * RIB (Routing Information Base) size in the number of entries.
- */
-#define XSTACK_IP_RIB_SIZE          5
-
 /**
  * Max number of deferred IP packets.
  * Maximum number of IP packets waiting for transmission, ie. waiting for ARP
  * to provide a destination MAC address.
  */
-#define XSTACK_IP_DEFER_MAX         20
+#define XSTACK_IP_DEFER_MAX         64
+
+/**
+ * Size of the buffer store for deferred IP packets [bytes].
+ */
+#define XSTACK_IP_DEFER_BYTES       (256 * 1024)
+
+/**
+ * Max number of bytes deferred for a single next hop.
+ */
+#define XSTACK_IP_DEFER_NEIGH_BYTES (64 * 1024)
+
+/**
+ * Max number of next hops that can have deferred packets at the same time.
+ */
+#define XSTACK_IP_DEFER_NEIGH_MAX   16
+
+/**
+ * Destination cache size in entries per thread.
+ * Must be a power of two.
+ */
+#define XSTACK_IP_DST_CACHE_SIZE    16
+
+/**
+ * Max number of destinations with a learned path MTU.
+ */
+#define XSTACK_IP_PMTU_SIZE         64
+
+/**
+ * Time after which a learned path MTU expires [sec].
+ * RFC 1191 recommends 10 minutes.
+ */
+#define XSTACK_IP_PMTU_AGE          600
+
+/**
+ * The smallest path MTU accepted from ICMP messages.
+ * A smaller reported MTU is raised to this and the DF flag is no longer set
+ * for the destination.
+ */
+#define XSTACK_IP_PMTU_MIN          552
 
 /**
  * Unreachable destination IP.
@@ -65,9 +243,16 @@
 #define XSTACK_IP_SEND_HOSTUNREAC   1
 
 /**
- * The number of buffers reserved for IP fragment reassembly.
+ * Max number of datagrams reassembled concurrently.
+ */
+#define XSTACK_IP_FRAGMENT_BUF      256
+
+/**
+ * Memory limit for IP fragment reassembly [bytes].
+ * The reassembly buffers are sized by the datagram length and the oldest
+ * datagrams are dropped when the limit is reached.
  */
-#define XSTACK_IP_FRAGMENT_BUF      4
+#define XSTACK_IP_FRAGMENT_MEM      (4 * 1024 * 1024)
 
 /**
  * IP fragment reassembly timer lower bound [sec].
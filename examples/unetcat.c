@@ -4,11 +4,15 @@
 #include <unistd.h>
 
 #include "xstack_socket.h"
+#include "xstack_util.h"
 
-static char buf[2048];
+#define BURST 16
+
+static char buf[BURST][2048];
 
 int main(void)
 {
+    struct xstack_mmsghdr msgs[BURST];
     void * sock;
 
     sock = xstack_listen("/tmp/unetcat.sock");
@@ -17,13 +21,19 @@ int main(void)
         exit(1);
     }
 
+    for (size_t i = 0; i < num_elem(msgs); i++) {
+        msgs[i] = (struct xstack_mmsghdr){
+            .msg_buf = buf[i],
+            .msg_buflen = sizeof(buf[i]),
+        };
+    }
+
     while (1) {
-        struct xstack_sockaddr addr;
-        size_t r;
+        int n;
 
-        memset(buf, 0, sizeof(buf));
-        r = xstack_recvfrom(sock, buf, sizeof(buf) - 1, 0, &addr);
-        if (r > 0)
-            write(STDOUT_FILENO, buf, r);
+        n = xstack_recvmmsg(sock, msgs, num_elem(msgs), 0);
+        for (int i = 0; i < n; i++) {
+            write(STDOUT_FILENO, msgs[i].msg_buf, msgs[i].msg_len);
+        }
     }
 }
@@ -0,0 +1,65 @@
+/**
+ * Doorbell for the shared memory queues.
+ * A consumer parks itself on the doorbell before sleeping and the producer
+ * only rings it, with a syscall, if the consumer is actually parked.
+ * The doorbell may live in memory shared between processes.
+ * @addtogroup doorbell
+ * @{
+ */
+
+#ifndef DOORBELL_H
+#define DOORBELL_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Doorbell.
+ * Nonzero when the consumer is parked. Used as a futex word.
+ */
+typedef uint32_t doorbell_t;
+
+/**
+ * Park the consumer.
+ * The consumer must recheck its queue after parking and unpark itself if
+ * the queue is not empty, otherwise a wakeup may be lost.
+ * @param bell is a pointer to the doorbell.
+ */
+void doorbell_park(doorbell_t * bell);
+
+/**
+ * Unpark the consumer.
+ * @param bell is a pointer to the doorbell.
+ */
+void doorbell_unpark(doorbell_t * bell);
+
+/**
+ * Wait on a parked doorbell until it's rung.
+ * Returns immediately if the doorbell was already rung.
+ * @param bell is a pointer to the doorbell.
+ * @param timeout is a relative timeout or NULL.
+ * @returns 0 if the doorbell was rung;
+ *          Otherwise -1 is returned and errno is set.
+ */
+int doorbell_wait(doorbell_t * bell, const struct timespec * timeout);
+
+/**
+ * Clear the doorbell after publishing new data.
+ * @param bell is a pointer to the doorbell.
+ * @returns 1 if the consumer was parked and needs to be woken up;
+ *          Otherwise 0.
+ */
+int doorbell_clear(doorbell_t * bell);
+
+/**
+ * Ring the doorbell after publishing new data.
+ * A futex wake is only issued if the consumer was parked.
+ * @param bell is a pointer to the doorbell.
+ */
+void doorbell_ring(doorbell_t * bell);
+
+#endif /* DOORBELL_H */
+
+/**
+ * @}
+ */
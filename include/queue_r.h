@@ -42,60 +42,118 @@
 #define QUEUE_R_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Cache line size assumed for the queue indices.
+ */
+#define QUEUE_CACHE_LINE 64
 
 /**
  * Queue control block.
+ * A single producer single consumer ring. The indices are free running and
+ * only masked when converted to a slot, thus the whole array is usable and
+ * a_len must be a power of two.
+ * The control block may live in memory shared between processes, the
+ * producer and consumer ends are kept on separate cache lines and each end
+ * keeps a cached copy of the opposite index to avoid touching the other
+ * end's cache line on every operation.
  */
 typedef struct queue_cb {
     size_t b_size;  /*!< Block size in bytes. */
-    size_t a_len;   /*!< Array length. */
-    size_t m_write; /*!< Write index. */
-    size_t m_read;  /*!< Read index. */
-} queue_cb_t;
+    size_t a_len;   /*!< Array length, a power of two. */
+    /* Producer end. */
+    size_t m_write __attribute__((aligned(QUEUE_CACHE_LINE))); /*!< Write index. */
+    size_t m_read_cache;    /*!< Producer's copy of m_read. */
+    size_t m_pend;          /*!< Allocated but uncommitted records end. */
+    /* Consumer end. */
+    size_t m_read __attribute__((aligned(QUEUE_CACHE_LINE))); /*!< Read index. */
+    size_t m_write_cache;   /*!< Consumer's copy of m_write. */
+} __attribute__((aligned(QUEUE_CACHE_LINE))) queue_cb_t;
 
-#define QUEUE_INITIALIZER(block_size, array_size)   \
-    (struct queue_cb){                              \
-        .b_size = (block_size),                     \
-        .a_len = (array_size / block_size),         \
-        .m_write = 0,                               \
-        .m_read = 0,                                \
-        }
+/**
+ * Size of the record header preceding each record in a record queue.
+ */
+#define QUEUE_REC_HDR_SIZE 8
 
 /**
  * Create a new queue control block.
  * Initializes a new queue control block and returns it as a value.
  * @param block_size the size of single data block/struct/data type in
  *                   data_array in bytes.
- * @param arra_size the size of the data_array in bytes.
+ * @param arra_size the size of the data_array in bytes. The number of blocks
+ *                  is rounded down to a power of two.
  * @return a new queue_cb_t queue control block structure.
  */
 queue_cb_t queue_create(size_t block_size, size_t array_size);
 
 /**
- * Allocate an element from the queue.
+ * Record queues.
+ * A record queue stores variable length records in a byte array. Each record
+ * is prefixed with a header of QUEUE_REC_HDR_SIZE bytes and padded to a
+ * multiple of the block size, records never wrap around the end of the array
+ * but the tail is skipped with a wrap marker instead. Therefore the array
+ * must fit at least two records of the maximum size.
+ * The record functions take a pointer to the data array as its address may
+ * differ between the processes sharing the queue.
+ * @{
+ */
+
+/**
+ * Allocate a record from the queue.
+ * Several records can be allocated before committing them at once.
+ * Must be called from the push end.
  * @param cb is a pointer to the queue control block.
+ * @param data is a pointer to the data array.
+ * @param size is the size of the record in bytes.
+ * @return the location of the record in the data array or -1 if the queue
+ *         is full.
  */
-int queue_alloc(queue_cb_t * cb);
+int queue_rec_alloc(queue_cb_t * cb, uint8_t * data, size_t size);
 
 /**
- * Commit previous allocation from the queue.
+ * Commit all the records allocated from the queue.
+ * Must be called from the push end.
+ * @param cb is a pointer to the queue control block.
  */
-void queue_commit(queue_cb_t * cb);
+void queue_rec_commit(queue_cb_t * cb);
 
 /**
- * Peek an element from the queue.
+ * Peek a record from the queue.
+ * Must be called from the pop end.
  * @param cb is a pointer to the queue control block.
- * @param index is the location where element is located in the buffer.
+ * @param data is a pointer to the data array.
+ * @param[out] index is set to the location of the record in the data array.
  * @return 0 if queue is empty; otherwise operation was succeed.
  */
-int queue_peek(queue_cb_t * cb, int * index);
+int queue_rec_peek(queue_cb_t * cb, uint8_t * data, int * index);
+
+/**
+ * Peek up to n records from the queue.
+ * Must be called from the pop end.
+ * @param cb is a pointer to the queue control block.
+ * @param data is a pointer to the data array.
+ * @param[out] index is an array of at least n entries set to the locations of
+ *                   the records in the data array in queue order.
+ * @param n is the maximum number of records.
+ * @return the number of records available.
+ */
+size_t queue_rec_peek_bulk(queue_cb_t * cb, uint8_t * data, int * index,
+                           size_t n);
 
 /**
- * Discard n number of elements in the queue from the read end.
+ * Discard n records from the read end of the queue.
+ * Must be called from the pop end.
  * @param cb is a pointer to the queue control block.
- * @return Returns the number of elements skipped.
+ * @param data is a pointer to the data array.
+ * @param n is the number of records.
+ * @return Returns the number of records skipped.
+ */
+int queue_rec_discard(queue_cb_t * cb, uint8_t * data, size_t n);
+
+/**
+ * @}
  */
-int queue_discard(queue_cb_t * cb, size_t n);
 
 /**
  * Clear the queue.
@@ -10,21 +10,49 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include "doorbell.h"
 #include "linker_set.h"
 #include "queue_r.h"
 #include "xstack_in.h"
 
-#define XSTACK_SHMEM_SIZE \
-    (sizeof(struct xstack_sock_ctrl) + \
+/**
+ * Size of the control block in the shared memory.
+ * Padded so that the queue control blocks following it start on a cache
+ * line boundary.
+ */
+#define XSTACK_SOCK_CTRL_SIZE \
+    ((sizeof(struct xstack_sock_ctrl) + QUEUE_CACHE_LINE - 1) & \
+     ~(size_t)(QUEUE_CACHE_LINE - 1))
+
+/**
+ * Size of the shared memory of a socket.
+ * @param ring_size is the size of a single socket ring in bytes.
+ */
+#define XSTACK_SHMEM_SIZE(ring_size) \
+    (XSTACK_SOCK_CTRL_SIZE + \
      2 * sizeof(struct queue_cb) + \
-     2 * XSTACK_DATAGRAM_BUF_SIZE)
+     2 * (size_t)(ring_size))
+
+/**
+ * Socket ring granularity.
+ * Datagrams are stored in the rings padded to a multiple of this.
+ */
+#define XSTACK_SOCK_RING_GRANULE 64
+
+/**
+ * Minimum size of a socket ring.
+ * A ring must fit at least two maximum size datagrams.
+ */
+#define XSTACK_SOCK_RING_MIN \
+    (2 * (QUEUE_REC_HDR_SIZE + sizeof(struct xstack_dgram) + \
+          XSTACK_DATAGRAM_SIZE_MAX))
 
 #define XSTACK_SOCK_CTRL(x) \
     ((struct xstack_sock_ctrl *)(x))
 
 #define XSTACK_INGRESS_QADDR(x) \
     ((struct queue_cb *)((uintptr_t)XSTACK_SOCK_CTRL(x) + \
-                         sizeof(struct xstack_sock_ctrl)))
+                         XSTACK_SOCK_CTRL_SIZE))
 
 #define XSTACK_INGRESS_DADDR(x) \
     ((uint8_t *)((uintptr_t)XSTACK_INGRESS_QADDR(x) + \
@@ -32,7 +60,7 @@
 
 #define XSTACK_EGRESS_QADDR(x) \
     ((struct queue_cb *)((uintptr_t)XSTACK_INGRESS_DADDR(x) + \
-                         XSTACK_DATAGRAM_BUF_SIZE))
+                         XSTACK_SOCK_CTRL(x)->ring_size))
 
 #define XSTACK_EGRESS_DADDR(x) \
     ((uint8_t *)((uintptr_t)XSTACK_EGRESS_QADDR(x) + \
@@ -84,6 +112,9 @@ struct xstack_sockaddr {
 struct xstack_sock_ctrl {
     pid_t pid_inetd;
     pid_t pid_end;
+    doorbell_t ingress_bell;    /*!< The end is waiting for ingress data. */
+    doorbell_t egress_bell;     /*!< Inetd is waiting for egress data. */
+    size_t ring_size;           /*!< Size of each ring in bytes. */
 };
 
 struct xstack_sock_info {
@@ -102,12 +133,82 @@ struct xstack_dgram {
 
 #define XSTACK_MSG_PEEK 0x1
 
+/**
+ * A message for xstack_recvmmsg() and xstack_sendmmsg().
+ */
+struct xstack_mmsghdr {
+    struct xstack_sockaddr msg_addr; /*!< Source or destination address. */
+    void * msg_buf;     /*!< Message buffer. */
+    size_t msg_buflen;  /*!< Size of msg_buf. */
+    size_t msg_len;     /*!< Number of bytes received or sent. */
+};
+
+/**
+ * Max number of messages handled by a single xstack_recvmmsg() call.
+ */
+#define XSTACK_MMSG_VLEN_MAX 64
+
 void * xstack_listen(const char * socket_path);
 ssize_t xstack_recvfrom(void * socket, void * restrict buffer, size_t length,
                         int flags, struct xstack_sockaddr * restrict address);
 ssize_t xstack_sendto(void * socket, const void * buffer, size_t length,
                       int flags, const struct xstack_sockaddr * dest_addr);
 
+/**
+ * Receive multiple datagrams.
+ * Blocks until at least one datagram is available and then receives up to
+ * vlen datagrams, or XSTACK_MMSG_VLEN_MAX, whichever is smaller, with a
+ * single queue update.
+ * @param socket is a pointer to the socket returned by xstack_listen().
+ * @param msgvec is an array of messages, msg_buf and msg_buflen must be set.
+ * @param vlen is the number of elements in msgvec.
+ * @param flags can be XSTACK_MSG_PEEK.
+ * @returns the number of messages received;
+ *          Otherwise -1 is returned and errno is set.
+ */
+int xstack_recvmmsg(void * socket, struct xstack_mmsghdr * msgvec,
+                    unsigned vlen, int flags);
+
+/**
+ * Borrow received datagrams.
+ * Like xstack_recvmmsg() but instead of copying, msg_buf of each message is
+ * pointed to the datagram in the shared memory ring. The datagrams stay
+ * queued, as with XSTACK_MSG_PEEK, and remain valid until they are released
+ * with xstack_recv_release(). A borrowed datagram may be modified in place.
+ * @param socket is a pointer to the socket returned by xstack_listen().
+ * @param msgvec is an array of messages to be filled.
+ * @param vlen is the number of elements in msgvec.
+ * @returns the number of messages borrowed;
+ *          Otherwise -1 is returned and errno is set.
+ */
+int xstack_recv_borrow(void * socket, struct xstack_mmsghdr * msgvec,
+                       unsigned vlen);
+
+/**
+ * Release borrowed datagrams.
+ * Releases the n oldest datagrams of the socket, the datagrams must not be
+ * accessed after the release.
+ * @param socket is a pointer to the socket returned by xstack_listen().
+ * @param n is the number of datagrams to release.
+ * @returns the number of datagrams released.
+ */
+int xstack_recv_release(void * socket, unsigned n);
+
+/**
+ * Send multiple datagrams.
+ * Blocks until at least one datagram can be queued and then queues as many
+ * of the vlen datagrams as fit, inetd is woken up at most once.
+ * @param socket is a pointer to the socket returned by xstack_listen().
+ * @param msgvec is an array of messages, msg_addr, msg_buf and msg_buflen
+ *               must be set.
+ * @param vlen is the number of elements in msgvec.
+ * @param flags is unused.
+ * @returns the number of messages sent;
+ *          Otherwise -1 is returned and errno is set.
+ */
+int xstack_sendmmsg(void * socket, struct xstack_mmsghdr * msgvec,
+                    unsigned vlen, int flags);
+
 #endif /* XSTACK_SOCKET_H */
 
 /**
@@ -60,6 +60,18 @@ static inline unsigned long ulmin(unsigned long a, unsigned long b)
 static inline unsigned int smin(size_t a, size_t b)
 { return (a < b ? a : b); }
 
+/**
+ * Hint the CPU that we are in a spin-wait loop.
+ */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
 static inline unsigned int uround_up(unsigned n, unsigned s)
 {
     return ((n + s - 1) / s) * s;
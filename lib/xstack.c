@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "xstack_socket.h"
@@ -11,20 +12,10 @@
 
 /* TODO bind fn for outbound connections */
 
-static void block_sigusr2(void)
-{
-    sigset_t sigset;
-
-    sigemptyset(&sigset);
-    sigaddset(&sigset, SIGUSR2);
-
-    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL) == -1) {
-        abort();
-    }
-}
-
 void * xstack_listen(const char * socket_path)
 {
+    struct stat st;
+    size_t ring_size;
     int fd;
     void * pa;
 
@@ -33,77 +24,220 @@ void * xstack_listen(const char * socket_path)
         return NULL;
     }
 
-    pa = mmap(0, XSTACK_SHMEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    /* The ring size is set by inetd so map the whole file. */
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < XSTACK_SHMEM_SIZE(0)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pa = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
     if (pa == MAP_FAILED) {
         return NULL;
     }
 
-    block_sigusr2();
+    ring_size = XSTACK_SOCK_CTRL(pa)->ring_size;
+    if (ring_size == 0 || (size_t)st.st_size < XSTACK_SHMEM_SIZE(ring_size)) {
+        munmap(pa, st.st_size);
+        errno = ECONNREFUSED;
+        return NULL;
+    }
+
     XSTACK_SOCK_CTRL(pa)->pid_end = getpid();
 
     return pa;
 }
 
-ssize_t xstack_recvfrom(void * socket, void * restrict buffer, size_t length,
-                        int flags, struct xstack_sockaddr * restrict address)
+/**
+ * Wait for an ingress datagram.
+ * Spin for a while before parking on the doorbell, inetd only issues a
+ * wakeup syscall if we are parked.
+ */
+static void ingress_wait(void * socket, int * dgram_index)
 {
+    struct xstack_sock_ctrl * ctrl = XSTACK_SOCK_CTRL(socket);
     struct queue_cb * ingress_q = XSTACK_INGRESS_QADDR(socket);
-    struct xstack_dgram * dgram;
-    sigset_t sigset;
-    int dgram_index;
-    ssize_t rd;
+    uint8_t * ingress_data = XSTACK_INGRESS_DADDR(socket);
+    unsigned spin = 0;
+
+    while (!queue_rec_peek(ingress_q, ingress_data, dgram_index)) {
+        if (spin++ < XSTACK_SOCK_SPIN_COUNT) {
+            cpu_relax();
+            continue;
+        }
+
+        doorbell_park(&ctrl->ingress_bell);
+        if (!queue_rec_peek(ingress_q, ingress_data, dgram_index)) {
+            const struct timespec timeout = {
+                .tv_sec = XSTACK_PERIODIC_EVENT_SEC,
+                .tv_nsec = 0,
+            };
+
+            doorbell_wait(&ctrl->ingress_bell, &timeout);
+        }
+        doorbell_unpark(&ctrl->ingress_bell);
+    }
+}
 
-    sigemptyset(&sigset);
-    sigaddset(&sigset, SIGUSR2);
+/**
+ * Wait for ingress datagrams and peek up to n of them.
+ * @returns the number of datagrams peeked.
+ */
+static size_t ingress_peek(void * socket, int * dgram_index, size_t n)
+{
+    ingress_wait(socket, &dgram_index[0]);
 
-    do {
-        struct timespec timeout = {
-            .tv_sec = XSTACK_PERIODIC_EVENT_SEC,
-            .tv_nsec = 0,
-        };
+    return queue_rec_peek_bulk(XSTACK_INGRESS_QADDR(socket),
+                               XSTACK_INGRESS_DADDR(socket), dgram_index, n);
+}
 
-        sigtimedwait(&sigset, NULL, &timeout);
-    } while (!queue_peek(ingress_q, &dgram_index));
-    dgram = (struct xstack_dgram *)(XSTACK_INGRESS_DADDR(socket) + dgram_index);
+int xstack_recvmmsg(void * socket, struct xstack_mmsghdr * msgvec,
+                    unsigned vlen, int flags)
+{
+    uint8_t * ingress_data = XSTACK_INGRESS_DADDR(socket);
+    int dgram_index[XSTACK_MMSG_VLEN_MAX];
+    size_t n;
 
-    if (address) {
-        *address = dgram->srcaddr;
+    if (vlen == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    n = ingress_peek(socket, dgram_index, min(vlen, num_elem(dgram_index)));
+    for (size_t i = 0; i < n; i++) {
+        struct xstack_mmsghdr * msg = &msgvec[i];
+        const struct xstack_dgram * dgram;
+
+        dgram = (struct xstack_dgram *)(ingress_data + dgram_index[i]);
+        msg->msg_addr = dgram->srcaddr;
+        msg->msg_len = smin(msg->msg_buflen, dgram->buf_size);
+        memcpy(msg->msg_buf, dgram->buf, msg->msg_len);
     }
-    rd = smin(length, dgram->buf_size);
-    memcpy(buffer, dgram->buf, rd);
-    dgram = NULL;
 
     if (!(flags & XSTACK_MSG_PEEK)) {
-        queue_discard(ingress_q, 1);
+        queue_rec_discard(XSTACK_INGRESS_QADDR(socket), ingress_data, n);
     }
 
-    return rd;
+    return n;
 }
 
-ssize_t xstack_sendto(void * socket, const void * buffer, size_t length,
-                      int flags, const struct xstack_sockaddr * dest_addr)
+int xstack_recv_borrow(void * socket, struct xstack_mmsghdr * msgvec,
+                       unsigned vlen)
 {
-    const struct xstack_sock_ctrl * ctrl = XSTACK_SOCK_CTRL(socket);
-    struct queue_cb * egress_q = XSTACK_EGRESS_QADDR(socket);
-    struct xstack_dgram * dgram;
-    int dgram_index;
+    uint8_t * ingress_data = XSTACK_INGRESS_DADDR(socket);
+    int dgram_index[XSTACK_MMSG_VLEN_MAX];
+    size_t n;
+
+    if (vlen == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    n = ingress_peek(socket, dgram_index, min(vlen, num_elem(dgram_index)));
+    for (size_t i = 0; i < n; i++) {
+        struct xstack_mmsghdr * msg = &msgvec[i];
+        struct xstack_dgram * dgram;
+
+        dgram = (struct xstack_dgram *)(ingress_data + dgram_index[i]);
+        msg->msg_addr = dgram->srcaddr;
+        msg->msg_buf = dgram->buf;
+        msg->msg_buflen = dgram->buf_size;
+        msg->msg_len = dgram->buf_size;
+    }
+
+    return n;
+}
 
-    if (length > XSTACK_DATAGRAM_SIZE_MAX) {
-        errno = ENOBUFS;
+int xstack_recv_release(void * socket, unsigned n)
+{
+    return queue_rec_discard(XSTACK_INGRESS_QADDR(socket),
+                             XSTACK_INGRESS_DADDR(socket), n);
+}
+
+ssize_t xstack_recvfrom(void * socket, void * restrict buffer, size_t length,
+                        int flags, struct xstack_sockaddr * restrict address)
+{
+    struct xstack_mmsghdr msg = {
+        .msg_buf = buffer,
+        .msg_buflen = length,
+    };
+
+    if (xstack_recvmmsg(socket, &msg, 1, flags) == -1) {
         return -1;
     }
 
-    while ((dgram_index = queue_alloc(egress_q)) == -1);
-    dgram = (struct xstack_dgram *)(XSTACK_EGRESS_DADDR(socket) + dgram_index);
+    if (address) {
+        *address = msg.msg_addr;
+    }
+
+    return msg.msg_len;
+}
 
-    /* Ignored by the implementation */
-    memset(&dgram->srcaddr, 0, sizeof(struct xstack_sockaddr));
+int xstack_sendmmsg(void * socket, struct xstack_mmsghdr * msgvec,
+                    unsigned vlen, int flags)
+{
+    struct xstack_sock_ctrl * ctrl = XSTACK_SOCK_CTRL(socket);
+    struct queue_cb * egress_q = XSTACK_EGRESS_QADDR(socket);
+    uint8_t * egress_data = XSTACK_EGRESS_DADDR(socket);
+    unsigned n;
+
+    for (n = 0; n < vlen; n++) {
+        struct xstack_mmsghdr * msg = &msgvec[n];
+        struct xstack_dgram * dgram;
+        int dgram_index;
+
+        if (msg->msg_buflen > XSTACK_DATAGRAM_SIZE_MAX) {
+            if (n == 0) {
+                errno = ENOBUFS;
+                return -1;
+            }
+            break;
+        }
+
+        /* Only wait for the first datagram to fit. */
+        do {
+            dgram_index = queue_rec_alloc(egress_q, egress_data,
+                                          sizeof(*dgram) + msg->msg_buflen);
+        } while (dgram_index == -1 && n == 0);
+        if (dgram_index == -1) {
+            break;
+        }
+        dgram = (struct xstack_dgram *)(egress_data + dgram_index);
+
+        /* Ignored by the implementation */
+        memset(&dgram->srcaddr, 0, sizeof(struct xstack_sockaddr));
+
+        dgram->dstaddr = msg->msg_addr;
+        dgram->buf_size = msg->msg_buflen;
+        memcpy(dgram->buf, msg->msg_buf, msg->msg_buflen);
+        msg->msg_len = msg->msg_buflen;
+    }
 
-    dgram->dstaddr = *dest_addr;
-    memcpy(dgram->buf, buffer, length);
+    queue_rec_commit(egress_q);
+    if (doorbell_clear(&ctrl->egress_bell)) {
+        kill(ctrl->pid_inetd, SIGUSR2);
+    }
 
-    queue_commit(egress_q);
-    kill(ctrl->pid_inetd, SIGUSR2);
+    return n;
+}
+
+ssize_t xstack_sendto(void * socket, const void * buffer, size_t length,
+                      int flags, const struct xstack_sockaddr * dest_addr)
+{
+    struct xstack_mmsghdr msg = {
+        .msg_addr = *dest_addr,
+        .msg_buf = (void *)buffer,
+        .msg_buflen = length,
+    };
+
+    if (xstack_sendmmsg(socket, &msg, 1, flags) == -1) {
+        return -1;
+    }
 
-    return length;
+    return msg.msg_len;
 }
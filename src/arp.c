@@ -1,38 +1,91 @@
 #include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "xstack_util.h"
 
 #include "ip_defer.h"
 #include "logger.h"
-#include "tree.h"
+#include "timer.h"
 #include "xstack_arp.h"
 #include "xstack_ether.h"
 #include "xstack_internal.h"
 #include "xstack_ip.h"
 
 #define ARP_CACHE_AGE_MAX (20 * 60 * 60) /* Expiration time */
+#define ARP_CACHE_SLOTS_MIN 16 /* Initial size of the hash table. */
+/*
+ * Entries in use are probed during the last periods before the expiration.
+ */
+#define ARP_CACHE_PROBE_AHEAD (3 * XSTACK_PERIODIC_EVENT_SEC)
 
+/**
+ * ARP cache entry.
+ * An unused slot has ip_addr set to 0.
+ */
 struct arp_cache_entry {
     in_addr_t ip_addr;
     mac_addr_t haddr;
-    int age;
-    RB_ENTRY(arp_cache_entry) _entry;
+    uint8_t referenced;     /*!< Clock bit, set when the entry is used. */
+    uint8_t probes;         /*!< Requests sent for an incomplete entry. */
+    uint8_t used;           /*!< Looked up since the last periodic update. */
+    int age;                /*!< Time since the last confirmation or type. */
+    in_addr_t probe_spa;    /*!< Source address of the requests. */
+    uint32_t probe_time;    /*!< The next request is due at [ms]. */
 };
 
-RB_HEAD(arp_cache_tree, arp_cache_entry);
+/*
+ * The ARP cache is an open addressing hash table with linear probing. It's
+ * kept at most half full and grows on demand until XSTACK_ARP_CACHE_SIZE
+ * entries, after which dynamic entries are evicted with the clock algorithm.
+ */
+static struct arp_cache_entry * arp_cache;
+static size_t arp_cache_bits;   /*!< log2 of the number of slots. */
+static size_t arp_cache_nr;     /*!< Number of entries in use. */
+static size_t arp_cache_hand;   /*!< Clock hand for the eviction. */
+/*
+ * Requests are sent while holding the lock so the lock must never be taken
+ * while a transmit buffer is reserved.
+ */
+static pthread_mutex_t arp_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned arp_cache_gen = 1; /*!< Incremented on changes, never 0. */
+
+/*
+ * Retransmissions of all incomplete entries are driven by a single timer
+ * because the entries move in the hash table. Protected by arp_cache_lock.
+ */
+static struct timer arp_probe_timer;
+static uint32_t arp_probe_due; /*!< Expiration of arp_probe_timer [ms]. */
+
+/**
+ * Token bucket limiting the rate of all ARP requests.
+ */
+static struct {
+    unsigned tokens;
+    uint32_t time;          /*!< Last refill [ms]. */
+} arp_request_bucket = { .tokens = XSTACK_ARP_REQUEST_RATE };
 
-static struct arp_cache_entry arp_cache[XSTACK_ARP_CACHE_SIZE];
-static struct arp_cache_tree arp_cache_head = RB_INITIALIZER();
+static int arp_request(int ether_handle, const mac_addr_t dst,
+                       in_addr_t spa, in_addr_t tpa);
 
-static int arp_cache_cmp(struct arp_cache_entry * a, struct arp_cache_entry * b)
+/**
+ * Invalidate the link addresses cached outside of ARP.
+ * Only changes and removals of existing mappings need this, and finding out
+ * whether an entry about to expire is still in use.
+ */
+static void arp_cache_changed(void)
 {
-    return a->ip_addr - b->ip_addr;
+    if (__atomic_add_fetch(&arp_cache_gen, 1, __ATOMIC_RELEASE) == 0) {
+        __atomic_store_n(&arp_cache_gen, 1, __ATOMIC_RELEASE);
+    }
 }
 
-RB_GENERATE_STATIC(arp_cache_tree, arp_cache_entry, _entry, arp_cache_cmp);
-
-static int arp_request(int ether_handle, in_addr_t spa, in_addr_t tpa);
+unsigned arp_cache_generation(void)
+{
+    return __atomic_load_n(&arp_cache_gen, __ATOMIC_ACQUIRE);
+}
 
 static void arp_hton(const struct arp_ip * host, struct arp_ip * net)
 {
@@ -60,102 +113,490 @@ static void arp_ntoh(const struct arp_ip * net, struct arp_ip * host)
     host->arp_tpa = ntohl(net->arp_tpa);
 }
 
+static inline size_t arp_cache_slots(void)
+{
+    return (arp_cache) ? (size_t)1 << arp_cache_bits : 0;
+}
+
+static inline size_t arp_cache_mask(void)
+{
+    return arp_cache_slots() - 1;
+}
+
+static inline size_t arp_cache_hash(in_addr_t ip_addr)
+{
+    return (uint32_t)(ip_addr * 0x9e3779b1u) >> (32 - arp_cache_bits);
+}
+
+/**
+ * Find an entry.
+ * @returns a pointer to the entry or NULL if not found.
+ */
+static struct arp_cache_entry * arp_cache_find(in_addr_t ip_addr)
+{
+    const size_t mask = arp_cache_mask();
+
+    if (!arp_cache) {
+        return NULL;
+    }
+
+    for (size_t i = arp_cache_hash(ip_addr);; i = (i + 1) & mask) {
+        struct arp_cache_entry * entry = &arp_cache[i];
+
+        if (entry->ip_addr == ip_addr) {
+            return entry;
+        } else if (entry->ip_addr == 0) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Get an unused slot for ip_addr.
+ * The table must have free slots.
+ */
+static struct arp_cache_entry * arp_cache_slot(in_addr_t ip_addr)
+{
+    const size_t mask = arp_cache_mask();
+    size_t i = arp_cache_hash(ip_addr);
+
+    while (arp_cache[i].ip_addr) {
+        i = (i + 1) & mask;
+    }
+
+    return &arp_cache[i];
+}
+
+/**
+ * Free a slot.
+ * The following entries of the probe sequence are shifted back so that no
+ * tombstones are needed.
+ */
+static void arp_cache_slot_free(struct arp_cache_entry * entry)
+{
+    const size_t mask = arp_cache_mask();
+    size_t i = entry - arp_cache;
+    size_t j = i;
+
+    if (entry->age == ARP_CACHE_INCOMPLETE) {
+        ip_defer_drop(entry->ip_addr);
+    }
+
+    while (arp_cache[j = (j + 1) & mask].ip_addr) {
+        const size_t k = arp_cache_hash(arp_cache[j].ip_addr);
+
+        /* The entry at j can't move if its home slot k is in (i, j]. */
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        arp_cache[i] = arp_cache[j];
+        i = j;
+    }
+
+    arp_cache[i] = (struct arp_cache_entry){ .age = ARP_CACHE_FREE };
+    arp_cache_nr--;
+}
+
+/**
+ * Double the size of the hash table.
+ */
+static int arp_cache_grow(void)
+{
+    struct arp_cache_entry * old = arp_cache;
+    const size_t old_nr = arp_cache_slots();
+    size_t bits = (old) ? arp_cache_bits + 1 : 0;
+    struct arp_cache_entry * new;
+
+    while (((size_t)1 << bits) < ARP_CACHE_SLOTS_MIN) {
+        bits++;
+    }
+
+    new = calloc((size_t)1 << bits, sizeof(struct arp_cache_entry));
+    if (!new) {
+        return -1;
+    }
+    for (size_t i = 0; i < ((size_t)1 << bits); i++) {
+        new[i].age = ARP_CACHE_FREE;
+    }
+
+    arp_cache = new;
+    arp_cache_bits = bits;
+    arp_cache_hand = 0;
+    for (size_t i = 0; i < old_nr; i++) {
+        if (old[i].ip_addr) {
+            *arp_cache_slot(old[i].ip_addr) = old[i];
+        }
+    }
+    free(old);
+
+    return 0;
+}
+
+/**
+ * Evict a dynamic entry that hasn't been used since the clock hand passed
+ * it the last time.
+ */
+static int arp_cache_evict(void)
+{
+    const size_t mask = arp_cache_mask();
+
+    /* The second round finds an entry unless all entries are static. */
+    for (size_t n = 0; n < 2 * arp_cache_slots(); n++) {
+        struct arp_cache_entry * entry = &arp_cache[arp_cache_hand];
+
+        arp_cache_hand = (arp_cache_hand + 1) & mask;
+        if (entry->ip_addr == 0 || entry->age == ARP_CACHE_STATIC) {
+            continue;
+        }
+        if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+
+        arp_cache_slot_free(entry);
+        arp_cache_changed();
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * Allocate a new entry for ip_addr.
+ * The caller must initialize the entry.
+ * @returns a pointer to the entry or NULL if the cache is full of static
+ *          entries.
+ */
+static struct arp_cache_entry * arp_cache_alloc(in_addr_t ip_addr)
+{
+    struct arp_cache_entry * entry;
+
+    /* Keep the table at most half full. */
+    if (arp_cache_nr >= XSTACK_ARP_CACHE_SIZE ||
+        (2 * (arp_cache_nr + 1) > arp_cache_slots() && arp_cache_grow())) {
+        if (arp_cache_evict()) {
+            return NULL;
+        }
+    }
+
+    entry = arp_cache_slot(ip_addr);
+    entry->ip_addr = ip_addr;
+    arp_cache_nr++;
+
+    return entry;
+}
+
+static uint32_t arp_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Take a token for sending a request.
+ * @returns 0 if a request can be sent; -1 if the rate limit was reached.
+ */
+static int arp_request_take(uint32_t now)
+{
+    /* A full second refills the bucket; clamp so the product can't wrap. */
+    const uint32_t elapsed = min(now - arp_request_bucket.time, 1000u);
+    const unsigned refill = elapsed * XSTACK_ARP_REQUEST_RATE / 1000;
+
+    if (refill > 0) {
+        arp_request_bucket.tokens = min(arp_request_bucket.tokens + refill,
+                                        XSTACK_ARP_REQUEST_RATE);
+        arp_request_bucket.time = now;
+    }
+    if (arp_request_bucket.tokens == 0) {
+        return -1;
+    }
+    arp_request_bucket.tokens--;
+
+    return 0;
+}
+
+/**
+ * Send the next request for an incomplete entry if one is due.
+ * A request that is rate limited is tried again on the next call.
+ * @returns 0 if the resolution is in progress; -1 if it failed.
+ */
+static int arp_cache_probe(struct arp_cache_entry * entry, uint32_t now)
+{
+    struct ip_route route;
+
+    if ((int32_t)(now - entry->probe_time) < 0) {
+        return 0;
+    }
+    if (entry->probes >= XSTACK_ARP_REQUEST_MAX ||
+        ip_route_find_by_iface(entry->probe_spa, &route)) {
+        return -1;
+    }
+    if (arp_request_take(now)) {
+        return 0;
+    }
+
+    if (arp_request(route.r_iface_handle, mac_broadcast_addr, route.r_iface,
+                    entry->ip_addr)) {
+        LOG(LOG_WARN, "Failed to send an ARP request");
+    }
+    entry->probe_time = now + (XSTACK_ARP_RETRANS_MS << entry->probes);
+    entry->probes++;
+
+    return 0;
+}
+
+/**
+ * Make sure the probe timer expires by the time due.
+ */
+static void arp_probe_schedule(uint32_t due, uint32_t now)
+{
+    /* Wait for a token if the request was rate limited. */
+    const uint32_t min_delay = 1000 / XSTACK_ARP_REQUEST_RATE + 1;
+    int32_t delay = due - now;
+
+    if (timer_pending(&arp_probe_timer) &&
+        (int32_t)(arp_probe_due - now) <= delay) {
+        return;
+    }
+
+    delay = (delay < (int32_t)min_delay) ? (int32_t)min_delay : delay;
+    arp_probe_due = now + delay;
+    timer_arm(&arp_probe_timer, delay);
+}
+
+/**
+ * Send the requests due for incomplete entries and free the entries that
+ * failed to resolve.
+ */
+static void arp_probe_timer_fn(struct timer * timer __unused)
+{
+    const uint32_t now = arp_now_ms();
+    uint32_t due = 0;
+    int incomplete = 0;
+
+    pthread_mutex_lock(&arp_cache_lock);
+
+    /*
+     * Freeing a slot may shift the following entries back so the same slot
+     * is checked again.
+     */
+    for (size_t i = 0; i < arp_cache_slots(); i++) {
+        struct arp_cache_entry * entry = &arp_cache[i];
+
+        while (entry->ip_addr && entry->age == ARP_CACHE_INCOMPLETE) {
+            if (arp_cache_probe(entry, now)) {
+                arp_cache_slot_free(entry);
+                continue;
+            }
+            if (!incomplete || (int32_t)(entry->probe_time - due) < 0) {
+                due = entry->probe_time;
+            }
+            incomplete = 1;
+            break;
+        }
+    }
+
+    if (incomplete) {
+        arp_probe_schedule(due, now);
+    }
+
+    pthread_mutex_unlock(&arp_cache_lock);
+}
+
+/**
+ * Ask an entry in use to confirm its address before it expires.
+ * The probe is sent directly to the cached address so it doesn't disturb
+ * other hosts, the reply confirms the entry as any other ARP message.
+ */
+static void arp_cache_refresh(struct arp_cache_entry * entry, uint32_t now)
+{
+    struct ip_route route;
+
+    if (ip_route_find_by_network(entry->ip_addr, &route) ||
+        arp_request_take(now)) {
+        return;
+    }
+
+    if (arp_request(route.r_iface_handle, entry->haddr, route.r_iface,
+                    entry->ip_addr)) {
+        LOG(LOG_WARN, "Failed to send an ARP probe");
+    }
+}
+
 int arp_cache_insert(in_addr_t ip_addr, const mac_addr_t haddr,
                      enum arp_cache_entry_type type)
 {
-    size_t i;
-    struct arp_cache_entry * it;
-    struct arp_cache_entry * entry = NULL;
+    struct arp_cache_entry * entry;
+    int resolved = 0;
+    int retval = 0;
 
     if (ip_addr == 0) {
         return 0;
     }
 
-    it = arp_cache;
-    for (i = 0; i < num_elem(arp_cache); i++) {
-        if (it->age == ARP_CACHE_FREE) {
-            entry = it;
-        } else if ((entry && entry->age > it->age) ||
-                   (!entry && it->age >= 0)) {
-            entry = it;
+    pthread_mutex_lock(&arp_cache_lock);
+
+    entry = arp_cache_find(ip_addr);
+    if (entry) {
+        /* Only touch the entry if something changes. */
+        if (entry->age == ARP_CACHE_STATIC && type != ARP_CACHE_STATIC) {
+            goto out;
         }
-        /* TODO Use RB_FIND first */
-        if (it->ip_addr == ip_addr) {
-            /* This is a replacement for an existing entry. */
-            entry = it;
-            break;
+        if (entry->age == ARP_CACHE_INCOMPLETE) {
+            memcpy(entry->haddr, haddr, sizeof(mac_addr_t));
+            resolved = 1;
+        } else if (memcmp(entry->haddr, haddr, sizeof(mac_addr_t))) {
+            memcpy(entry->haddr, haddr, sizeof(mac_addr_t));
+            arp_cache_changed();
+        }
+        if (entry->age != (int)type) {
+            entry->age = (int)type;
         }
-        it++;
+        if (!entry->referenced) {
+            entry->referenced = 1;
+        }
+        goto out;
     }
+
+    entry = arp_cache_alloc(ip_addr);
     if (!entry) {
         errno = ENOMEM;
-        return -1;
-    } else if (entry->age >= 0) {
-        RB_REMOVE(arp_cache_tree, &arp_cache_head, entry);
+        retval = -1;
+        goto out;
     }
-
-    entry->ip_addr = ip_addr;
     memcpy(entry->haddr, haddr, sizeof(mac_addr_t));
+    entry->referenced = 1;
+    entry->used = 0;
     entry->age = (int)type;
-    RB_INSERT(arp_cache_tree, &arp_cache_head, entry);
 
-    return 0;
-}
+out:
+    pthread_mutex_unlock(&arp_cache_lock);
 
-static struct arp_cache_entry * arp_cache_get_entry(in_addr_t ip_addr)
-{
-    struct arp_cache_entry find = {
-        .ip_addr = ip_addr,
-    };
+    if (resolved) {
+        ip_defer_flush(ip_addr);
+    }
 
-    return RB_FIND(arp_cache_tree, &arp_cache_head, &find);
+    return retval;
 }
 
 void arp_cache_remove(in_addr_t ip_addr)
 {
-    struct arp_cache_entry * entry = arp_cache_get_entry(ip_addr);
+    struct arp_cache_entry * entry;
 
-    RB_REMOVE(arp_cache_tree, &arp_cache_head, entry);
-    if (entry)
-        entry->age = ARP_CACHE_FREE;
+    pthread_mutex_lock(&arp_cache_lock);
+    entry = arp_cache_find(ip_addr);
+    if (entry) {
+        arp_cache_slot_free(entry);
+        arp_cache_changed();
+    }
+    pthread_mutex_unlock(&arp_cache_lock);
 }
 
 int arp_cache_get_haddr(in_addr_t iface, in_addr_t ip_addr, mac_addr_t haddr)
 {
-    struct arp_cache_entry * entry = arp_cache_get_entry(ip_addr);
-    struct ip_route route;
+    struct arp_cache_entry * entry;
+    int retval = 0;
 
-    if (entry && entry->age >= 0) {
+    pthread_mutex_lock(&arp_cache_lock);
+
+    entry = arp_cache_find(ip_addr);
+    if (entry && entry->age != ARP_CACHE_INCOMPLETE) {
         memcpy(haddr, entry->haddr, sizeof(mac_addr_t));
-        return 0;
+        entry->referenced = 1;
+        entry->used = 1;
+        goto out;
     }
 
-    if (!ip_route_find_by_iface(iface, &route) &&
-        !arp_request(route.r_iface_handle, route.r_iface, ip_addr)) {
+    if (!entry) {
+        entry = arp_cache_alloc(ip_addr);
+        if (!entry) {
+            errno = ENOMEM;
+            retval = -1;
+            goto out;
+        }
+        memset(entry->haddr, 0, sizeof(mac_addr_t));
+        entry->referenced = 0;
+        entry->used = 0;
+        entry->age = ARP_CACHE_INCOMPLETE;
+        entry->probes = 0;
+        entry->probe_spa = iface;
+        entry->probe_time = arp_now_ms();
+    }
+
+    if (arp_cache_probe(entry, arp_now_ms())) {
+        arp_cache_slot_free(entry);
+        errno = EHOSTDOWN;
+    } else {
+        arp_probe_schedule(entry->probe_time, arp_now_ms());
         errno = EHOSTUNREACH;
     }
+    retval = -1;
 
-    return -1;
+out:
+    pthread_mutex_unlock(&arp_cache_lock);
+    return retval;
 }
 
 static void arp_cache_update(int delta_time)
 {
-    size_t i;
+    const int probe_age = ARP_CACHE_AGE_MAX - ARP_CACHE_PROBE_AHEAD;
+    const uint32_t now = arp_now_ms();
+    int expiring = 0;
 
-    for (i = 0; i < num_elem(arp_cache); i++) {
+    pthread_mutex_lock(&arp_cache_lock);
+
+    for (size_t i = 0; i < arp_cache_slots(); i++) {
         struct arp_cache_entry * entry = &arp_cache[i];
 
-        if (entry->age > ARP_CACHE_AGE_MAX) {
-            entry->age = ARP_CACHE_FREE;
-        } else if (entry->age >= 0) {
+        if (entry->ip_addr && entry->age >= 0) {
             entry->age += delta_time;
+            if (entry->age > probe_age &&
+                entry->age - delta_time <= probe_age) {
+                expiring = 1;
+            }
+            if (entry->used && entry->age > probe_age &&
+                entry->age <= ARP_CACHE_AGE_MAX) {
+                arp_cache_refresh(entry, now);
+            }
+            entry->used = 0;
         }
     }
+
+    /*
+     * Freeing a slot may shift the following entries back so the same slot
+     * is checked again.
+     */
+    for (size_t i = 0; i < arp_cache_slots(); i++) {
+        struct arp_cache_entry * entry = &arp_cache[i];
+
+        while (entry->ip_addr && entry->age > ARP_CACHE_AGE_MAX) {
+            arp_cache_slot_free(entry);
+            arp_cache_changed();
+        }
+    }
+
+    /*
+     * The users of the cache don't look up the entries they have cached, so
+     * when an entry gets close to expiring make them look the entries up
+     * again to see whether it's still in use before the next update.
+     */
+    if (expiring) {
+        arp_cache_changed();
+    }
+
+    pthread_mutex_unlock(&arp_cache_lock);
 }
 XSTACK_PERIODIC_TASK(arp_cache_update);
 
+__constructor void arp_init(void)
+{
+    timer_init(&arp_probe_timer, arp_probe_timer_fn);
+}
+
 static int arp_input(const struct ether_hdr * hdr __unused, uint8_t * payload,
-                     size_t bsize)
+                     size_t bsize, unsigned flags __unused)
 {
     struct arp_ip * arp_net = (struct arp_ip *)payload;
     struct arp_ip arp;
@@ -170,12 +611,12 @@ static int arp_input(const struct ether_hdr * hdr __unused, uint8_t * payload,
         struct ip_route route;
         char str_ip[IP_STR_LEN];
 
-        /* Add sender to the ARP cache */
+        /*
+         * Add sender to the ARP cache, this also sends the packets deferred
+         * for the sender.
+         */
         arp_cache_insert(arp.arp_spa, arp.arp_sha, ARP_CACHE_DYN);
 
-        /* Check for deferred IP packet transmissions */
-        ip_defer_handler(0);
-
         /* Process the opcode */
         switch (arp.arp_oper) {
         case ARP_OPER_REQUEST:
@@ -209,14 +650,25 @@ static int arp_input(const struct ether_hdr * hdr __unused, uint8_t * payload,
 ETHER_PROTO_INPUT_HANDLER(ETHER_PROTO_ARP, arp_input);
 
 /**
- * @param[in] sha
+ * Send an ARP request.
+ * The message is built directly in a transmit buffer.
+ * @param[in] dst is the destination link address, mac_broadcast_addr for a
+ *                normal request or the cached address for a unicast probe.
  * @param[in] spa
  * @param[in] tpa
- * @param[out] tha
  */
-static int arp_request(int ether_handle, in_addr_t spa, in_addr_t tpa)
+static int arp_request(int ether_handle, const mac_addr_t dst,
+                       in_addr_t spa, in_addr_t tpa)
 {
-    struct arp_ip msg = {
+    struct arp_ip * msg;
+    int retval;
+
+    msg = (struct arp_ip *)ether_tx_alloc(ether_handle);
+    if (!msg) {
+        return -errno;
+    }
+
+    *msg = (struct arp_ip){
         .arp_htype = ARP_HTYPE_ETHER,
         .arp_ptype = ETHER_PROTO_IPV4,
         .arp_hlen = ETHER_ALEN,
@@ -225,45 +677,31 @@ static int arp_request(int ether_handle, in_addr_t spa, in_addr_t tpa)
         .arp_spa = spa,
         .arp_tpa = tpa,
     };
-    int retval;
-
-    ether_handle2addr(ether_handle, msg.arp_sha);
-    memset(msg.arp_tha, 0, sizeof(mac_addr_t));
+    ether_handle2addr(ether_handle, msg->arp_sha);
+    memset(msg->arp_tha, 0, sizeof(mac_addr_t));
+    arp_hton(msg, msg);
 
-    arp_hton(&msg, &msg);
-    retval = ether_send(ether_handle, mac_broadcast_addr, ETHER_PROTO_ARP,
-                        (uint8_t *)(&msg), sizeof(msg));
+    retval = ether_tx_commit(ether_handle, dst, ETHER_PROTO_ARP, sizeof(*msg));
+    if (retval >= 0) {
+        retval = ether_tx_flush(ether_handle);
+    }
 
     return (retval < 0) ? retval : 0;
 }
 
 int arp_gratuitous(int ether_handle, in_addr_t spa)
 {
-    struct arp_ip msg = {
-        .arp_htype = ARP_HTYPE_ETHER,
-        .arp_ptype = ETHER_PROTO_IPV4,
-        .arp_hlen = ETHER_ALEN,
-        .arp_plen = sizeof(in_addr_t),
-        .arp_oper = ARP_OPER_REQUEST,
-        .arp_spa = spa,
-        .arp_tpa = spa,
-    };
     char str_ip[IP_STR_LEN];
     int retval;
 
-    ether_handle2addr(ether_handle, msg.arp_sha);
-    memset(msg.arp_tha, 0, sizeof(mac_addr_t));
-
     ip2str(spa, str_ip);
     LOG(LOG_DEBUG, "Announce %s", str_ip);
 
-    arp_hton(&msg, &msg);
-    retval = ether_send(ether_handle, mac_broadcast_addr, ETHER_PROTO_ARP,
-                        (uint8_t *)(&msg), sizeof(msg));
+    retval = arp_request(ether_handle, mac_broadcast_addr, spa, spa);
     if (retval < 0) {
         char errmsg[40];
 
-        strerror_r(errno, errmsg, sizeof(errmsg));
+        strerror_r(-retval, errmsg, sizeof(errmsg));
         LOG(LOG_WARN, "Failed to announce %s: %s", str_ip, errmsg);
     }
 
@@ -0,0 +1,22 @@
+#include "cpu_features.h"
+
+unsigned cpu_features(void)
+{
+    unsigned features = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    /* Required when called from a constructor. */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        features |= CPU_FEATURE_SSE2;
+    }
+    if (__builtin_cpu_supports("pclmul")) {
+        features |= CPU_FEATURE_PCLMUL;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        features |= CPU_FEATURE_AVX2;
+    }
+#endif
+
+    return features;
+}
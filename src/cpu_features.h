@@ -0,0 +1,35 @@
+/**
+ * @addtogroup cpu_features
+ * CPU feature probing.
+ * The vectorized engines tag themselves with the features they need and the
+ * first engine in the order of preference whose features are all present is
+ * selected at startup.
+ * @{
+ */
+
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#define CPU_FEATURE_SSE2    0x1
+#define CPU_FEATURE_PCLMUL  0x2
+#define CPU_FEATURE_AVX2    0x4
+
+/**
+ * Probe the CPU.
+ * @returns a mask of CPU_FEATURE_ flags supported by the CPU.
+ */
+unsigned cpu_features(void);
+
+/**
+ * Test whether the CPU supports all the features in a mask.
+ */
+static inline int cpu_supports(unsigned mask)
+{
+    return (cpu_features() & mask) == mask;
+}
+
+#endif /* CPU_FEATURES_H */
+
+/**
+ * @}
+ */
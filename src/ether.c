@@ -1,14 +1,204 @@
 #include <errno.h>
+#include <string.h>
 
 #include "logger.h"
 #include "xstack_ether.h"
 
+#define ETHER_MAX_IF    4
+
+/**
+ * An ether handle.
+ */
+struct ether_if {
+    const struct ether_driver * drv;
+    int drv_handle;                 /*!< Handle returned by the driver. */
+};
+
 SET_DECLARE(_ether_proto_handlers, struct _ether_proto_handler);
+SET_DECLARE(_ether_drivers, struct ether_driver);
 
 const mac_addr_t mac_broadcast_addr = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
-int ether_input(const struct ether_hdr * hdr, uint8_t * payload, size_t bsize)
+static struct ether_if ether_ifs[ETHER_MAX_IF];
+static int ether_next_handle;
+
+const char * ether_opt_value(const char * opt, const char * name)
+{
+    const size_t len = strlen(name);
+
+    if (strncmp(opt, name, len) || opt[len] != '=') {
+        return NULL;
+    }
+    return opt + len + 1;
+}
+
+static struct ether_if * ether_handle2if(int handle)
+{
+    if (handle < 0 || handle >= ether_next_handle) {
+        errno = ENODEV;
+        return NULL;
+    }
+    return &ether_ifs[handle];
+}
+
+int ether_init(const char * driver, char * const args[])
+{
+    struct ether_driver ** tmpp;
+    struct ether_driver * drv = NULL;
+    struct ether_if * eif;
+    int drv_handle;
+
+    if (ether_next_handle >= ETHER_MAX_IF) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (!driver) {
+        driver = XSTACK_ETHER_DRIVER;
+    }
+    SET_FOREACH(tmpp, _ether_drivers) {
+        if (!strcmp((*tmpp)->name, driver)) {
+            drv = *tmpp;
+            break;
+        }
+    }
+    if (!drv) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    drv_handle = drv->init(args);
+    if (drv_handle == -1) {
+        return -1;
+    }
+
+    eif = &ether_ifs[ether_next_handle];
+    eif->drv = drv;
+    eif->drv_handle = drv_handle;
+
+    return ether_next_handle++;
+}
+
+void ether_deinit(int handle)
+{
+    struct ether_if * eif;
+
+    if (!(eif = ether_handle2if(handle))) {
+        return;
+    }
+
+    eif->drv->deinit(eif->drv_handle);
+}
+
+int ether_handle2addr(int handle, mac_addr_t addr)
+{
+    struct ether_if * eif;
+
+    if (!(eif = ether_handle2if(handle))) {
+        return -1;
+    }
+
+    return eif->drv->handle2addr(eif->drv_handle, addr);
+}
+
+int ether_addr2handle(const mac_addr_t addr)
 {
+    for (int handle = 0; handle < ether_next_handle; handle++) {
+        mac_addr_t mac;
+
+        if (!ether_handle2addr(handle, mac) &&
+            !memcmp(mac, addr, sizeof(mac_addr_t))) {
+            return handle;
+        }
+    }
+
+    errno = ENODEV;
+    return -1;
+}
+
+int ether_add_inet4_addr(int handle, uint32_t addr, uint32_t netmask)
+{
+    struct ether_if * eif;
+
+    if (!(eif = ether_handle2if(handle))) {
+        return -errno;
+    }
+
+    if (!eif->drv->add_inet4_addr) {
+        return 0;
+    }
+    return eif->drv->add_inet4_addr(eif->drv_handle, addr, netmask);
+}
+
+int ether_receive_burst(int handle, struct ether_frame * frames, size_t nr)
+{
+    struct ether_if * eif;
+
+    if (!(eif = ether_handle2if(handle))) {
+        return -1;
+    }
+
+    return eif->drv->receive_burst(eif->drv_handle, frames, nr);
+}
+
+int ether_receive(int handle, struct ether_hdr * hdr, uint8_t * buf,
+                  size_t bsize)
+{
+    struct ether_frame frame;
+    int retval;
+
+    retval = ether_receive_burst(handle, &frame, 1);
+    if (retval > 0) {
+        *hdr = frame.hdr;
+        memcpy(buf, frame.payload, min(frame.bsize, bsize));
+        retval = (int)frame.bsize;
+    }
+
+    return retval;
+}
+
+uint8_t * ether_tx_alloc(int handle)
+{
+    struct ether_if * eif;
+
+    if (!(eif = ether_handle2if(handle))) {
+        return NULL;
+    }
+
+    return eif->drv->tx_alloc(eif->drv_handle);
+}
+
+int ether_tx_commit(int handle, const mac_addr_t dst, uint16_t proto,
+                    size_t bsize)
+{
+    /* The handle was already validated by ether_tx_alloc(). */
+    struct ether_if * eif = &ether_ifs[handle];
+
+    return eif->drv->tx_commit(eif->drv_handle, dst, proto, bsize);
+}
+
+void ether_tx_abort(int handle)
+{
+    /* The handle was already validated by ether_tx_alloc(). */
+    struct ether_if * eif = &ether_ifs[handle];
+
+    eif->drv->tx_abort(eif->drv_handle);
+}
+
+int ether_tx_flush(int handle)
+{
+    struct ether_if * eif;
+
+    if (!(eif = ether_handle2if(handle))) {
+        return -errno;
+    }
+
+    return eif->drv->tx_flush(eif->drv_handle);
+}
+
+int ether_input(const struct ether_frame * frame)
+{
+    const struct ether_hdr * hdr = &frame->hdr;
     struct _ether_proto_handler ** tmpp;
     struct _ether_proto_handler * proto;
     int retval;
@@ -24,7 +214,7 @@ int ether_input(const struct ether_hdr * hdr, uint8_t * payload, size_t bsize)
     LOG(LOG_DEBUG, "proto id: 0x%x", (unsigned)hdr->h_proto);
 
     if (proto) {
-        retval = proto->fn(hdr, payload, bsize);
+        retval = proto->fn(hdr, frame->payload, frame->bsize, frame->flags);
         if (retval < 0) {
             errno = -retval;
             retval = -1;
@@ -37,12 +227,45 @@ int ether_input(const struct ether_hdr * hdr, uint8_t * payload, size_t bsize)
     return retval;
 }
 
+int ether_send(int handle, const mac_addr_t dst, uint16_t proto,
+               uint8_t * buf, size_t bsize)
+{
+    uint8_t * data;
+    int retval;
+
+    if (bsize > ETHER_DATA_LEN) {
+        return -EMSGSIZE;
+    }
+
+    if (!(data = ether_tx_alloc(handle))) {
+        return -errno;
+    }
+    memcpy(data, buf, bsize);
+
+    retval = ether_tx_commit(handle, dst, proto, bsize);
+    if (retval >= 0) {
+        int err = ether_tx_flush(handle);
+
+        if (err < 0) {
+            retval = err;
+        }
+    }
+
+    return retval;
+}
+
 int ether_output_reply(int ether_handle, const struct ether_hdr * hdr,
                        uint8_t * payload, size_t bsize)
 {
+    uint8_t * data;
     int retval;
 
-    retval = ether_send(ether_handle, hdr->h_src, hdr->h_proto, payload, bsize);
+    if (!(data = ether_tx_alloc(ether_handle))) {
+        return -1;
+    }
+    memcpy(data, payload, min(bsize, ETHER_DATA_LEN));
+
+    retval = ether_tx_commit(ether_handle, hdr->h_src, hdr->h_proto, bsize);
     if (retval < 0) {
         errno = -retval;
         retval = -1;
@@ -1,23 +1,233 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
-uint32_t ether_fcs(const void * data, size_t bsize)
+#include "xstack_util.h"
+
+#include "cpu_features.h"
+#include "logger.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define FCS_HAVE_PCLMUL 1
+#endif
+
+#define CRC32_POLY 0xEDB88320 /* Reflected 0x04C11DB7 */
+
+/**
+ * A CRC32 engine.
+ * update() updates a running (inverted) CRC register with bsize bytes.
+ */
+struct crc32_engine {
+    const char * name;
+    unsigned features; /*!< Required CPU_FEATURE_ flags. */
+    uint32_t (*update)(uint32_t crc, const uint8_t * dp, size_t bsize);
+};
+
+static uint32_t crc_table[8][256];
+
+static void crc32_table_init(void)
 {
-    const uint8_t * dp = (uint8_t *)data;
-    const uint32_t crc_table[] =
-    {
-        0x4DBDF21C, 0x500AE278, 0x76D3D2D4, 0x6B64C2B0,
-        0x3B61B38C, 0x26D6A3E8, 0x000F9344, 0x1DB88320,
-        0xA005713C, 0xBDB26158, 0x9B6B51F4, 0x86DC4190,
-        0xD6D930AC, 0xCB6E20C8, 0xEDB71064, 0xF0000000
-    };
-    uint32_t crc = 0;
-    size_t i;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (CRC32_POLY & -(crc & 1));
+        }
+        crc_table[0][i] = crc;
+    }
 
-    for (i = 0; i < bsize; i++) {
-        crc = (crc >> 4) ^ crc_table[(crc ^ (dp[i] >> 0)) & 0x0F];
-        crc = (crc >> 4) ^ crc_table[(crc ^ (dp[i] >> 4)) & 0x0F];
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            const uint32_t prev = crc_table[t - 1][i];
+
+            crc_table[t][i] = (prev >> 8) ^ crc_table[0][prev & 0xff];
+        }
+    }
+}
+
+static uint32_t crc32_slice8_update(uint32_t crc, const uint8_t * dp,
+                                    size_t bsize)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; bsize >= 8; bsize -= 8, dp += 8) {
+        uint32_t lo, hi;
+
+        memcpy(&lo, dp, sizeof(lo));
+        memcpy(&hi, dp + 4, sizeof(hi));
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^
+              crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^
+              crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^
+              crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^
+              crc_table[0][hi >> 24];
+    }
+#endif
+
+    while (bsize--) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *dp++) & 0xff];
     }
 
     return crc;
 }
+
+#ifdef FCS_HAVE_PCLMUL
+/*
+ * Folding constants for the reflected CRC32 polynomial, see Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ".
+ */
+static const uint64_t k1k2[2] __attribute__((aligned(16))) = {
+    0x0154442bd4, 0x01c6e41596,
+};
+static const uint64_t k3k4[2] __attribute__((aligned(16))) = {
+    0x01751997d0, 0x00ccaa009e,
+};
+static const uint64_t k5k0[2] __attribute__((aligned(16))) = {
+    0x0163cd6124, 0x0000000000,
+};
+static const uint64_t poly[2] __attribute__((aligned(16))) = {
+    0x01db710641, 0x01f7011641,
+};
+
+/**
+ * Fold 64 bytes at a time with carry-less multiplication.
+ * bsize must be at least 64 and a multiple of 16.
+ */
+__attribute__((target("sse2,pclmul")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t * dp,
+                                  size_t bsize)
+{
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(dp + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(dp + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(dp + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(dp + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    dp += 64;
+    bsize -= 64;
+
+    /* Parallel fold blocks of 64 bytes. */
+    while (bsize >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(dp + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(dp + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(dp + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(dp + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        dp += 64;
+        bsize -= 64;
+    }
+
+    /* Fold into 128 bits. */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* Single fold blocks of 16 bytes. */
+    while (bsize >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)dp);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        dp += 16;
+        bsize -= 16;
+    }
+
+    /* Fold 128 bits to 64 bits. */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduce to 32 bits. */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* The second 32-bit lane, without requiring SSE4.1. */
+    return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+static uint32_t crc32_pclmul_update(uint32_t crc, const uint8_t * dp,
+                                    size_t bsize)
+{
+    if (bsize >= 64) {
+        const size_t n = bsize & ~(size_t)15;
+
+        crc = crc32_pclmul_fold(crc, dp, n);
+        dp += n;
+        bsize -= n;
+    }
+
+    return crc32_slice8_update(crc, dp, bsize);
+}
+#endif
+
+/**
+ * CRC32 engines in the order of preference.
+ */
+static const struct crc32_engine crc32_engines[] = {
+#ifdef FCS_HAVE_PCLMUL
+    {
+        .name = "pclmul",
+        .features = CPU_FEATURE_SSE2 | CPU_FEATURE_PCLMUL,
+        .update = crc32_pclmul_update,
+    },
+#endif
+    {
+        .name = "slice8",
+        .update = crc32_slice8_update,
+    },
+};
+
+static uint32_t (*crc32_update)(uint32_t crc, const uint8_t * dp,
+                                size_t bsize);
+
+__constructor void ether_fcs_init(void)
+{
+    crc32_table_init();
+
+    for (size_t i = 0; i < num_elem(crc32_engines); i++) {
+        if (cpu_supports(crc32_engines[i].features)) {
+            LOG(LOG_INFO, "Using %s", crc32_engines[i].name);
+            crc32_update = crc32_engines[i].update;
+            break;
+        }
+    }
+}
+
+uint32_t ether_fcs(const void * data, size_t bsize)
+{
+    return ~crc32_update(~(uint32_t)0, (const uint8_t *)data, bsize);
+}
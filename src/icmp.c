@@ -1,6 +1,8 @@
 #include <errno.h>
+#include <stddef.h>
 #include <string.h>
 
+#include "ip_pmtu.h"
 #include "logger.h"
 #include "xstack_icmp.h"
 #include "xstack_ip.h"
@@ -10,6 +12,7 @@ static void icmp_hton(const struct icmp * host, struct icmp * net)
     net->icmp_type  = host->icmp_type;
     net->icmp_code  = host->icmp_code;
     net->icmp_csum  = host->icmp_csum;
+    net->icmp_rest  = htonl(host->icmp_rest);
 }
 
 static void icmp_ntoh(const struct icmp * net, struct icmp * host)
@@ -17,6 +20,55 @@ static void icmp_ntoh(const struct icmp * net, struct icmp * host)
     host->icmp_type  = net->icmp_type;
     host->icmp_code  = net->icmp_code;
     host->icmp_csum  = net->icmp_csum;
+    host->icmp_rest  = ntohl(net->icmp_rest);
+}
+
+/**
+ * Guess the next hop MTU for a fragmentation needed message of a router
+ * that doesn't tell it, from the length of the original packet (RFC 1191).
+ */
+static size_t icmp_mtu_plateau(size_t len)
+{
+    static const uint16_t plateaus[] = {
+        32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68,
+    };
+
+    for (size_t i = 0; i < num_elem(plateaus); i++) {
+        if (plateaus[i] < len) {
+            return plateaus[i];
+        }
+    }
+
+    return plateaus[num_elem(plateaus) - 1];
+}
+
+/**
+ * Handle an ICMP fragmentation needed message.
+ */
+static void icmp_frag_needed(const struct icmp * hdr,
+                             const struct icmp_destunreac * msg,
+                             size_t bsize)
+{
+    struct ip_hdr orig;
+    size_t mtu;
+
+    if (bsize < offsetof(struct icmp_destunreac, data)) {
+        return;
+    }
+
+    /* The quoted header is unaligned in the packed message. */
+    memcpy(&orig, (const uint8_t *)msg + offsetof(struct icmp_destunreac,
+                                                  old_ip_hdr), sizeof(orig));
+    ip_ntoh(&orig, &orig);
+    if (ip_route_find_by_iface(orig.ip_src, NULL)) {
+        return; /* Not sent by us. */
+    }
+
+    mtu = hdr->icmp_rest & 0xffff;
+    if (mtu == 0 || mtu >= orig.ip_len) {
+        mtu = icmp_mtu_plateau(orig.ip_len);
+    }
+    ip_pmtu_update(orig.ip_dst, mtu);
 }
 
 static int icmp_input(const struct ip_hdr * ip_hdr __unused,
@@ -36,11 +88,18 @@ static int icmp_input(const struct ip_hdr * ip_hdr __unused,
     LOG(LOG_DEBUG, "ICMP type: %d", hdr.icmp_type);
     switch (hdr.icmp_type) {
     case ICMP_TYPE_ECHO_REQUEST:
+        /* Only the type changes so the payload needn't be summed again. */
         net_msg->icmp_type = ICMP_TYPE_ECHO_REPLY;
-        net_msg->icmp_csum = 0;
-        net_msg->icmp_csum = ip_checksum(net_msg, bsize);
+        net_msg->icmp_csum = ip_checksum_adjust(net_msg->icmp_csum, &hdr,
+                                                net_msg, 2);
 
         return bsize;
+    case ICMP_TYPE_DESTUNREAC:
+        if (hdr.icmp_code == ICMP_CODE_FRAGNEEDED) {
+            icmp_frag_needed(&hdr, (struct icmp_destunreac *)payload, bsize);
+        }
+
+        return 0;
     default:
         LOG(LOG_INFO, "Unkown ICMP message type");
 
@@ -69,13 +128,17 @@ int icmp_generate_dest_unreachable(struct ip_hdr * hdr, int code,
     };
     /* TODO Next-hop MTU if code is 4*/
     icmp_hton(&msg->icmp, &msg->icmp);
-    msg->icmp.icmp_csum = ip_checksum(msg, msg_size);
     ip_hton(hdr, &msg->old_ip_hdr);
+    msg->icmp.icmp_csum = ip_checksum(msg, msg_size);
 
     hdr->ip_vhl = IP_VHL_DEFAULT;
     hdr->ip_tos = IP_TOS_DEFAULT;
     hdr->ip_proto = IP_PROTO_ICMP;
-    msg_size += ip_reply_header(hdr, msg_size);
+    msg_size = ip_reply_header(hdr, msg_size);
+
+    /* Most of the header was rewritten so recalculate the checksum. */
+    hdr->ip_csum = 0;
+    hdr->ip_csum = ip_checksum(hdr, ip_hdr_hlen(hdr));
 
     return msg_size;
 }
@@ -4,6 +4,7 @@
 #include "xstack_in.h"
 
 #include "ip_defer.h"
+#include "ip_dst.h"
 #include "logger.h"
 #include "xstack_arp.h"
 #include "xstack_icmp.h"
@@ -12,62 +13,62 @@
 SET_DECLARE(_ip_proto_handlers, struct _ip_proto_handler);
 
 static unsigned ip_global_id; /* Global ID for IP packets. */
+static unsigned long ip_csum_errors; /* Packets dropped due to a bad checksum. */
 
-int ip_config(int ether_handle, in_addr_t ip_addr, in_addr_t netmask)
+int ip_config(int ether_handle, in_addr_t ip_addr, in_addr_t netmask,
+              in_addr_t gw)
 {
     mac_addr_t mac;
     struct ip_route route = {
         .r_network = ip_addr & netmask,
         .r_netmask = netmask,
-        .r_gw = 0, /* TODO GW support */
+        .r_gw = 0,
         .r_iface = ip_addr,
         .r_iface_handle = ether_handle,
     };
+    int retval;
+
+    if (gw && (gw & netmask) != route.r_network) {
+        errno = EINVAL;
+        return -1;
+    }
 
     ether_handle2addr(ether_handle, mac);
     arp_cache_insert(ip_addr, mac, ARP_CACHE_STATIC);
 
-    ip_route_update(&route);
-
-    /* Announce that we are online. */
-    for (size_t i = 0; i < 3; i++) {
-        arp_gratuitous(ether_handle, ip_addr);
+    retval = ether_add_inet4_addr(ether_handle, ip_addr, netmask);
+    if (retval) {
+        LOG(LOG_WARN, "Failed to update the link filter: %d", -retval);
     }
 
-    return 0;
-}
+    if (ip_route_update(&route)) {
+        return -1;
+    }
 
-uint16_t ip_checksum(void * dp, size_t bsize)
-{
-    uint8_t * data = (uint8_t *)dp;
-    uint32_t acc = 0xffff;
-    size_t i;
-    uint16_t word;
-
-    for (i = 0; i + 1 < bsize; i += 2) {
-        memcpy(&word, data + i, 2);
-        acc += word;
-        if (acc > 0xffff) {
-            acc -= ntohs(0xffff);
+    if (gw) {
+        struct ip_route default_route = {
+            .r_network = 0,
+            .r_netmask = 0,
+            .r_gw = gw,
+            .r_iface = ip_addr,
+            .r_iface_handle = ether_handle,
+        };
+
+        if (ip_route_update(&default_route)) {
+            return -1;
         }
     }
 
-    if (bsize & 1) {
-        word = 0;
-        memcpy(&word, data + bsize - 1, 1);
-        acc += word;
-        if (acc > 0xffff) {
-            acc -= ntohs(0xffff);
-        }
+    /* Announce that we are online. */
+    for (size_t i = 0; i < 3; i++) {
+        arp_gratuitous(ether_handle, ip_addr);
     }
 
-    return ~acc;
+    return 0;
 }
 
-void ip_hton(const struct ip_hdr * host, struct ip_hdr * net)
+static void ip_hton_fields(const struct ip_hdr * host, struct ip_hdr * net)
 {
-    size_t hlen = ip_hdr_hlen(host);
-
     net->ip_vhl = host->ip_vhl;
     net->ip_tos = host->ip_tos;
     net->ip_len = htons(host->ip_len);
@@ -78,6 +79,13 @@ void ip_hton(const struct ip_hdr * host, struct ip_hdr * net)
     net->ip_csum = host->ip_csum;
     net->ip_src = htonl(host->ip_src);
     net->ip_dst = htonl(host->ip_dst);
+}
+
+void ip_hton(const struct ip_hdr * host, struct ip_hdr * net)
+{
+    size_t hlen = ip_hdr_hlen(host);
+
+    ip_hton_fields(host, net);
 
     net->ip_csum = 0;
     net->ip_csum = ip_checksum(net, hlen);
@@ -99,9 +107,48 @@ size_t ip_ntoh(const struct ip_hdr * net, struct ip_hdr * host)
     return ip_hdr_hlen(host);
 }
 
+int ip_ntoh_verify(const struct ip_hdr * net, struct ip_hdr * host)
+{
+    const size_t hlen = ip_hdr_hlen(net);
+    uint32_t w[5], word;
+    uint64_t sum;
+
+    /*
+     * Load the fixed part of the header once and use the same words for
+     * both the sum and the conversion, this also makes it safe to convert
+     * in place.
+     */
+    memcpy(w, net, sizeof(w));
+    sum = (uint64_t)w[0] + w[1] + w[2] + w[3] + w[4];
+    if (hlen > sizeof(w)) {
+        sum += ip_checksum_partial(net->ip_opt, hlen - sizeof(w), 0);
+    }
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+
+    word = ntohl(w[0]);
+    host->ip_vhl = word >> 24;
+    host->ip_tos = (word >> 16) & 0xff;
+    host->ip_len = word & 0xffff;
+    word = ntohl(w[1]);
+    host->ip_id = word >> 16;
+    host->ip_foff = word & 0xffff;
+    word = ntohl(w[2]);
+    host->ip_ttl = word >> 24;
+    host->ip_proto = (word >> 16) & 0xff;
+    host->ip_csum = htons(word & 0xffff);
+    host->ip_src = ntohl(w[3]);
+    host->ip_dst = ntohl(w[4]);
+
+    return (ip_checksum_fold((uint32_t)sum) == 0) ? 0 : -1;
+}
+
 size_t ip_reply_header(struct ip_hdr * host_ip_hdr, size_t bsize)
 {
     struct ip_hdr * const ip = host_ip_hdr;
+    const uint16_t old_len = htons(ip->ip_len);
+    uint8_t old_ttl_proto[2] = { ip->ip_ttl, ip->ip_proto };
+    uint16_t new_len;
     in_addr_t tmp;
 
     /* Swap source and destination. */
@@ -113,58 +160,83 @@ size_t ip_reply_header(struct ip_hdr * host_ip_hdr, size_t bsize)
     bsize += ip_hdr_hlen(ip);
     ip->ip_len = bsize;
 
+    /*
+     * Swapping the addresses doesn't change the sum so only the TTL and
+     * the length need to be patched in the checksum.
+     */
+    new_len = htons(ip->ip_len);
+    ip->ip_csum = ip_checksum_adjust(ip->ip_csum, &old_len, &new_len,
+                                     sizeof(uint16_t));
+    ip->ip_csum = ip_checksum_adjust(ip->ip_csum, old_ttl_proto, &ip->ip_ttl,
+                                     sizeof(old_ttl_proto));
+
     /* Back to network order */
-    ip_hton(ip, ip);
+    ip_hton_fields(ip, ip);
 
     return bsize;
 }
 
-int ip_input(const struct ether_hdr * e_hdr, uint8_t * payload, size_t bsize)
+int ip_input(const struct ether_hdr * e_hdr, uint8_t * payload, size_t bsize,
+             unsigned flags)
 {
     struct ip_hdr * ip = (struct ip_hdr *)payload;
     struct _ip_proto_handler ** tmpp;
     struct _ip_proto_handler * proto;
     size_t hlen;
 
-    if (e_hdr) {
-        ip_ntoh(ip, ip);
+    if (bsize < sizeof(struct ip_hdr)) {
+        LOG(LOG_ERR, "Packet too short: %d", (int)bsize);
+        return 0;
     }
 
+    /* The version and header length are the same in both byte orders. */
     if ((ip->ip_vhl & 0x40) != 0x40) {
         LOG(LOG_ERR, "Unsupported IP packet version: 0x%x", ip->ip_vhl);
         return 0;
     }
 
     hlen = ip_hdr_hlen(ip);
-    if (hlen < 20) {
+    if (hlen < 20 || hlen > bsize) {
         LOG(LOG_ERR, "Incorrect packet header length: %d", (int)hlen);
         return 0;
     }
 
+    /*
+     * A NULL e_hdr means that the packet was reassembled locally and it's
+     * already in host order.
+     */
+    if (e_hdr) {
+        if (flags & ETHER_FRAME_CSUM_VALID) {
+            ip_ntoh(ip, ip);
+        } else if (ip_ntoh_verify(ip, ip)) {
+            ip_csum_errors++;
+            LOG(LOG_WARN, "Drop due to an invalid checksum (%lu)",
+                ip_csum_errors);
+            return 0;
+        }
+    }
+
     if (ip->ip_len != bsize) {
         LOG(LOG_ERR, "Packet size mismatch. iplen = %d, bsize = %d",
             (int)ip->ip_len, (int)bsize);
         return 0;
     }
 
-    /*
-     * RFE The packet header is already modified with ntoh so this wont work.
-     */
-#if 0
-    if (ip_checksum(ip, hlen) != 0) {
-        LOG(LOG_ERR, "Drop due to an invalid checksum");
-        return;
-    }
-#endif
-
     if (ip->ip_tos != IP_TOS_DEFAULT) {
         LOG(LOG_INFO, "Unsupported IP type of service or ECN: 0x%x",
             ip->ip_tos);
     }
 
     if (e_hdr) {
-        /* Insert to ARP table so it's possible/faster to send a reply. */
-        arp_cache_insert(ip->ip_src, e_hdr->h_src, ARP_CACHE_DYN);
+        const struct ip_dst * src_entry = ip_dst_get(ip->ip_src);
+
+        /*
+         * Insert to ARP table so it's possible/faster to send a reply.
+         * The link address of an off-link source belongs to a router.
+         */
+        if (src_entry && src_entry->nexthop == ip->ip_src) {
+            arp_cache_insert(ip->ip_src, e_hdr->h_src, ARP_CACHE_DYN);
+        }
     }
 
     if (ip_route_find_by_iface(ip->ip_dst, NULL)) {
@@ -222,52 +294,77 @@ int ip_input(const struct ether_hdr * e_hdr, uint8_t * payload, size_t bsize)
 }
 ETHER_PROTO_INPUT_HANDLER(ETHER_PROTO_IPV4, ip_input);
 
-static inline size_t ip_off_round(size_t plen)
+/**
+ * Copy len bytes starting from offset of the data gathered by iov.
+ */
+static void ip_iov_copy(uint8_t * dst, const struct iovec * iov, int iovcnt,
+                        size_t offset, size_t len)
 {
-    return (plen + 7) & ~7;
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        size_t n;
+
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        n = min(iov[i].iov_len - offset, len);
+        memcpy(dst, (const uint8_t *)iov[i].iov_base + offset, n);
+        dst += n;
+        len -= n;
+        offset = 0;
+    }
 }
 
+/**
+ * Get the payload size of the next fragment.
+ * All fragments but the last one must carry a multiple of 8 bytes.
+ */
 static size_t next_fragment_size(size_t bytes, size_t hlen, size_t mtu)
 {
-    size_t max, retval;
+    const size_t max = (mtu - hlen) & ~(size_t)7;
 
-    max = ip_off_round(mtu - hlen - 8); /* RFE A kernel bug? */
-    retval = (bytes < max) ? bytes : max;
-
-    return retval;
+    return (bytes < max) ? bytes : max;
 }
 
-static int ip_send_fragments(int ether_handle, const mac_addr_t dst_mac,
-                             uint8_t * payload, size_t bsize)
+/**
+ * Send a datagram in fragments.
+ * Each fragment is built directly in a transmit buffer from the header and
+ * a slice of the payload so the payload is copied only once.
+ * @param hdr is the header of the whole datagram in host order.
+ */
+static int ip_send_fragments(const struct ip_dst * dst_entry,
+                             struct ip_hdr * hdr, const struct iovec * iov,
+                             int iovcnt, size_t bsize)
 {
-    struct ip_hdr * ip_hdr_net = (struct ip_hdr *)payload;
-    struct ip_hdr ip_hdr;
-    uint8_t * data;
-    size_t hlen, bytes, offset = 0;
+    const size_t hlen = ip_hdr_hlen(hdr);
+    size_t offset = 0;
     int retval = 0;
 
-    hlen = ip_ntoh(ip_hdr_net, &ip_hdr);
-    data = payload + hlen;
-    bytes = bsize - hlen;
     do {
-        size_t plen;
+        const size_t plen = next_fragment_size(bsize - offset, hlen,
+                                               dst_entry->mtu);
+        uint8_t * data;
         int eret;
 
-        plen = next_fragment_size(bytes, hlen, ETHER_DATA_LEN);
-        bytes -= plen;
-        ip_hdr.ip_len = hlen + plen;
-        ip_hdr.ip_foff = ((bytes != 0) ? IP_FLAGS_MF : 0) | (offset >> 3);
+        data = ether_tx_alloc(dst_entry->ether_handle);
+        if (!data) {
+            return -errno;
+        }
+
+        hdr->ip_len = hlen + plen;
+        hdr->ip_foff = ((offset + plen < bsize) ? IP_FLAGS_MF : 0) |
+                       (offset >> 3);
+        ip_hton(hdr, (struct ip_hdr *)data);
+        ip_iov_copy(data + hlen, iov, iovcnt, offset, plen);
 
-        ip_hton(&ip_hdr, ip_hdr_net);
-        memmove(data, data + offset, plen);
-        eret = ether_send(ether_handle, dst_mac, ETHER_PROTO_IPV4,
-                          payload, ip_hdr.ip_len);
+        eret = ether_tx_commit(dst_entry->ether_handle, dst_entry->haddr,
+                               ETHER_PROTO_IPV4, hlen + plen);
         if (eret < 0) {
             return eret;
         }
         retval += eret;
         offset += plen;
-    } while (bytes > 0);
+    } while (offset < bsize);
 
     return retval;
 }
@@ -281,11 +378,28 @@ static const struct ip_hdr ip_hdr_template = {
 
 int ip_send(in_addr_t dst, uint8_t proto, const uint8_t * buf, size_t bsize)
 {
-    mac_addr_t dst_mac;
-    size_t packet_size = sizeof(struct ip_hdr) + bsize;
-    struct ip_route route;
+    const struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = bsize,
+    };
+
+    return ip_sendv(dst, proto, &iov, 1);
+}
 
-    if (ip_route_find_by_network(dst, &route)) {
+int ip_sendv(in_addr_t dst, uint8_t proto, const struct iovec * iov,
+             int iovcnt)
+{
+    size_t bsize = 0;
+    size_t packet_size;
+    struct ip_dst * dst_entry;
+
+    for (int i = 0; i < iovcnt; i++) {
+        bsize += iov[i].iov_len;
+    }
+    packet_size = sizeof(struct ip_hdr) + bsize;
+
+    dst_entry = ip_dst_get(dst);
+    if (!dst_entry) {
         char ip_str[IP_STR_LEN];
 
         ip2str(dst, ip_str);
@@ -294,52 +408,72 @@ int ip_send(in_addr_t dst, uint8_t proto, const uint8_t * buf, size_t bsize)
         return -1;
     }
 
-    if (arp_cache_get_haddr(route.r_iface, dst, dst_mac)) {
-        int retval = 0;
+    if (ip_dst_resolve(dst_entry)) {
+        int retval = -1;
 
         if (errno == EHOSTUNREACH) {
             /*
              * We must defer the operation for now because we are waiting for
              * the reveiver's MAC addr to be resolved.
              */
-            retval = ip_defer_push(dst, proto, buf, bsize);
-            if (retval == 0 || (retval == -EALREADY)) {
-                retval = 0; /* Return 0 to indicate an defered operation. */
-            } else { /* else an error occured. */
+            retval = ip_defer_pushv(dst_entry->nexthop, dst, proto,
+                                    iov, iovcnt);
+            if (retval < 0) {
                 errno = -retval;
                 retval = -1;
-            }
+            } /* else return 0 to indicate an defered operation. */
         }
         return retval;
     }
 
-    {
-        uint8_t packet[packet_size];
-        struct ip_hdr * hdr = (struct ip_hdr *)packet;
+    if (packet_size <= dst_entry->mtu) {
+        struct ip_hdr * hdr;
         int retval;
 
+        /* Build the packet directly in a transmit buffer. */
+        hdr = (struct ip_hdr *)ether_tx_alloc(dst_entry->ether_handle);
+        if (!hdr) {
+            return -1;
+        }
+
         memcpy(hdr, &ip_hdr_template, sizeof(ip_hdr_template));
+        if (!dst_entry->df) {
+            hdr->ip_foff = 0;
+        }
         hdr->ip_len = packet_size;
         hdr->ip_id = ip_global_id++;
-        hdr->ip_src = route.r_iface;
+        hdr->ip_src = dst_entry->src;
         hdr->ip_dst = dst;
         hdr->ip_proto = proto;
-        memcpy(packet + sizeof(ip_hdr_template), buf, bsize);
+        ip_iov_copy((uint8_t *)hdr + sizeof(ip_hdr_template), iov, iovcnt,
+                    0, bsize);
         ip_hton(hdr, hdr);
 
-        if (bsize <= ETHER_DATA_LEN) {
-            retval = ether_send(route.r_iface_handle, dst_mac, ETHER_PROTO_IPV4,
-                                packet, packet_size);
-        } else if (1) { /* Check DF flag */
-            retval = ip_send_fragments(route.r_iface_handle, dst_mac,
-                                       packet, packet_size);
-            if (retval < 0) {
-                errno = -retval;
-                retval = -1;
-            }
-        } else {
-            /* TODO Fail properly */
-            errno = EMSGSIZE;
+        retval = ether_tx_commit(dst_entry->ether_handle, dst_entry->haddr,
+                                 ETHER_PROTO_IPV4, packet_size);
+        if (retval < 0) {
+            errno = -retval;
+            retval = -1;
+        }
+
+        return retval;
+    } else {
+        struct ip_hdr hdr = ip_hdr_template;
+        int retval;
+
+        /*
+         * Packets that fit in the path MTU are sent with DF set, larger
+         * ones are fragmented here and the fragments may be fragmented
+         * further on the path.
+         */
+        hdr.ip_id = ip_global_id++;
+        hdr.ip_src = dst_entry->src;
+        hdr.ip_dst = dst;
+        hdr.ip_proto = proto;
+
+        retval = ip_send_fragments(dst_entry, &hdr, iov, iovcnt, bsize);
+        if (retval < 0) {
+            errno = -retval;
             retval = -1;
         }
 
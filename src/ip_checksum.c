@@ -0,0 +1,294 @@
+/**
+ * Internet checksum (RFC 1071).
+ * The sum is computed over native byte order words; the ones' complement
+ * sum is byte order independent so the folded result can be stored as is.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_HAVE_X86 1
+#endif
+
+#include "xstack_in.h"
+#include "xstack_util.h"
+
+#include "cpu_features.h"
+#include "logger.h"
+#include "xstack_ip.h"
+
+/**
+ * A checksum engine.
+ */
+struct csum_engine {
+    const char * name;
+    unsigned features; /*!< Required CPU_FEATURE_ flags. */
+    uint64_t (*sum)(const uint8_t * dp, size_t bsize);
+    uint64_t (*copy)(uint8_t * dst, const uint8_t * src, size_t bsize);
+};
+
+static inline uint32_t csum_fold64(uint64_t acc)
+{
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    acc = (acc & 0xffffffff) + (acc >> 32);
+
+    return (uint32_t)acc;
+}
+
+/**
+ * Sum the tail of a buffer shorter than 4 bytes.
+ */
+static inline uint64_t csum_tail(const uint8_t * dp, size_t bsize)
+{
+    uint64_t acc = 0;
+
+    if (bsize & 2) {
+        uint16_t word;
+
+        memcpy(&word, dp, sizeof(word));
+        acc += word;
+        dp += 2;
+    }
+    if (bsize & 1) {
+        uint16_t word = 0;
+
+        memcpy(&word, dp, 1);
+        acc += word;
+    }
+
+    return acc;
+}
+
+static uint64_t csum_scalar_sum(const uint8_t * dp, size_t bsize)
+{
+    uint64_t acc = 0;
+
+    for (; bsize >= 8; bsize -= 8, dp += 8) {
+        uint32_t w[2];
+
+        memcpy(w, dp, sizeof(w));
+        acc += (uint64_t)w[0] + w[1];
+    }
+    if (bsize >= 4) {
+        uint32_t w;
+
+        memcpy(&w, dp, sizeof(w));
+        acc += w;
+        dp += 4;
+        bsize -= 4;
+    }
+
+    return acc + csum_tail(dp, bsize);
+}
+
+static uint64_t csum_scalar_copy(uint8_t * dst, const uint8_t * src,
+                                 size_t bsize)
+{
+    uint64_t acc = 0;
+
+    for (; bsize >= 4; bsize -= 4, dst += 4, src += 4) {
+        uint32_t w;
+
+        memcpy(&w, src, sizeof(w));
+        memcpy(dst, &w, sizeof(w));
+        acc += w;
+    }
+    memcpy(dst, src, bsize);
+
+    return acc + csum_tail(src, bsize);
+}
+
+#ifdef CSUM_HAVE_X86
+/*
+ * The vector kernels widen 16-bit words to 32-bit lanes. A lane can take
+ * 2^15 additions of two words before it may overflow so the lanes are
+ * flushed to the 64-bit accumulator well before that.
+ */
+#define CSUM_FLUSH_BLOCKS 4096
+
+__attribute__((target("sse2")))
+static inline uint64_t csum_sse2_flush(__m128i v)
+{
+    uint32_t lanes[4];
+
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("sse2")))
+static inline __m128i csum_sse2_add(__m128i v, __m128i x)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    v = _mm_add_epi32(v, _mm_unpacklo_epi16(x, zero));
+    return _mm_add_epi32(v, _mm_unpackhi_epi16(x, zero));
+}
+
+__attribute__((target("sse2")))
+static uint64_t csum_sse2_sum(const uint8_t * dp, size_t bsize)
+{
+    uint64_t acc = 0;
+
+    while (bsize >= 16) {
+        __m128i v = _mm_setzero_si128();
+        size_t n = 0;
+
+        for (; bsize >= 16 && n < CSUM_FLUSH_BLOCKS; n++) {
+            v = csum_sse2_add(v, _mm_loadu_si128((const __m128i *)dp));
+            dp += 16;
+            bsize -= 16;
+        }
+        acc += csum_sse2_flush(v);
+    }
+
+    return acc + csum_scalar_sum(dp, bsize);
+}
+
+__attribute__((target("sse2")))
+static uint64_t csum_sse2_copy(uint8_t * dst, const uint8_t * src,
+                               size_t bsize)
+{
+    uint64_t acc = 0;
+
+    while (bsize >= 16) {
+        __m128i v = _mm_setzero_si128();
+        size_t n = 0;
+
+        for (; bsize >= 16 && n < CSUM_FLUSH_BLOCKS; n++) {
+            const __m128i x = _mm_loadu_si128((const __m128i *)src);
+
+            _mm_storeu_si128((__m128i *)dst, x);
+            v = csum_sse2_add(v, x);
+            dst += 16;
+            src += 16;
+            bsize -= 16;
+        }
+        acc += csum_sse2_flush(v);
+    }
+
+    return acc + csum_scalar_copy(dst, src, bsize);
+}
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2_sum(const uint8_t * dp, size_t bsize)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t acc = 0;
+
+    while (bsize >= 32) {
+        __m256i v = _mm256_setzero_si256();
+        uint32_t lanes[8];
+        size_t n = 0;
+
+        for (; bsize >= 32 && n < CSUM_FLUSH_BLOCKS; n++) {
+            const __m256i x = _mm256_loadu_si256((const __m256i *)dp);
+
+            v = _mm256_add_epi32(v, _mm256_unpacklo_epi16(x, zero));
+            v = _mm256_add_epi32(v, _mm256_unpackhi_epi16(x, zero));
+            dp += 32;
+            bsize -= 32;
+        }
+
+        _mm256_storeu_si256((__m256i *)lanes, v);
+        for (size_t i = 0; i < num_elem(lanes); i++) {
+            acc += lanes[i];
+        }
+    }
+
+    return acc + csum_sse2_sum(dp, bsize);
+}
+#endif
+
+/**
+ * Checksum engines in the order of preference.
+ */
+static const struct csum_engine csum_engines[] = {
+#ifdef CSUM_HAVE_X86
+    {
+        .name = "avx2",
+        .features = CPU_FEATURE_AVX2,
+        .sum = csum_avx2_sum,
+        .copy = csum_sse2_copy,
+    },
+    {
+        .name = "sse2",
+        .features = CPU_FEATURE_SSE2,
+        .sum = csum_sse2_sum,
+        .copy = csum_sse2_copy,
+    },
+#endif
+    {
+        .name = "scalar",
+        .sum = csum_scalar_sum,
+        .copy = csum_scalar_copy,
+    },
+};
+
+static const struct csum_engine * csum_engine;
+
+__constructor void ip_checksum_init(void)
+{
+    for (size_t i = 0; i < num_elem(csum_engines); i++) {
+        if (cpu_supports(csum_engines[i].features)) {
+            LOG(LOG_INFO, "Using %s", csum_engines[i].name);
+            csum_engine = &csum_engines[i];
+            break;
+        }
+    }
+}
+
+uint32_t ip_checksum_partial(const void * dp, size_t bsize, uint32_t sum)
+{
+    return csum_fold64(csum_engine->sum(dp, bsize) + sum);
+}
+
+uint32_t ip_checksum_copy(void * dst, const void * src, size_t bsize,
+                          uint32_t sum)
+{
+    return csum_fold64(csum_engine->copy(dst, src, bsize) + sum);
+}
+
+uint32_t ip_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t proto,
+                            uint16_t bsize)
+{
+    const uint32_t net_src = htonl(src);
+    const uint32_t net_dst = htonl(dst);
+
+    return csum_fold64((uint64_t)net_src + net_dst + htons(proto) +
+                       htons(bsize));
+}
+
+uint16_t ip_checksum_fold(uint32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return (uint16_t)~sum;
+}
+
+uint16_t ip_checksum(void * dp, size_t bsize)
+{
+    return ip_checksum_fold(ip_checksum_partial(dp, bsize, 0));
+}
+
+uint16_t ip_checksum_adjust(uint16_t csum, const void * old, const void * new,
+                            size_t bsize)
+{
+    const uint8_t * op = old;
+    const uint8_t * np = new;
+    uint32_t sum = (uint16_t)~csum;
+
+    /* HC' = ~(~HC + ~m + m') */
+    for (size_t i = 0; i + 1 < bsize; i += 2) {
+        uint16_t m, m1;
+
+        memcpy(&m, op + i, sizeof(m));
+        memcpy(&m1, np + i, sizeof(m1));
+        sum += (uint16_t)~m + m1;
+    }
+
+    return ip_checksum_fold(sum);
+}
@@ -1,102 +1,338 @@
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 
 #include "xstack_in.h"
+#include "xstack_util.h"
 
+#include "ip_defer.h"
 #include "logger.h"
+#include "queue.h"
 #include "xstack_ether.h"
 #include "xstack_internal.h"
 #include "xstack_ip.h"
 
+#define IP_DEFER_CHUNK_SIZE 512
+#define IP_DEFER_AGE_MAX    30 /* Drop packets waiting longer than this [s]. */
+/* Max number of chunks in a packet. */
+#define IP_DEFER_IOV_MAX \
+    ((XSTACK_IP_DEFER_NEIGH_BYTES + IP_DEFER_CHUNK_SIZE - 1) / \
+     IP_DEFER_CHUNK_SIZE)
+
+/**
+ * A buffer store chunk.
+ * The payload of a deferred packet is stored in a chain of chunks.
+ */
+struct ip_defer_chunk {
+    struct ip_defer_chunk * next;
+    uint8_t data[IP_DEFER_CHUNK_SIZE];
+};
+
 struct ip_defer {
-    int tries;
+    STAILQ_ENTRY(ip_defer) link;
     in_addr_t dst;
     uint8_t proto;
     size_t buf_size;
-    uint8_t buf[ETHER_ALEN];
+    struct ip_defer_chunk * chunks;
 };
 
-/*
- * This is used to inhibit defers if it's the ip deferring code itself causing
- * defer push.
+STAILQ_HEAD(ip_defer_queue, ip_defer);
+
+/**
+ * Packets waiting for the same next hop.
  */
-static unsigned defer_inhibit;
+struct ip_defer_neigh {
+    in_addr_t nexthop;      /*!< 0 if the queue is unused. */
+    int age;                /*!< Time since the first packet was queued. */
+    size_t bytes;           /*!< Bytes queued. */
+    struct ip_defer_queue queue;
+};
 
-static struct ip_defer ip_defer_queue[XSTACK_IP_DEFER_MAX];
-static size_t q_rd, q_wr;
+static struct ip_defer_chunk
+    defer_chunks[XSTACK_IP_DEFER_BYTES / IP_DEFER_CHUNK_SIZE];
+static struct ip_defer defer_pkts[XSTACK_IP_DEFER_MAX];
+static struct ip_defer_neigh defer_neigh[XSTACK_IP_DEFER_NEIGH_MAX];
+static struct ip_defer_chunk * defer_chunk_free;
+static struct ip_defer_queue defer_pkt_free;
+static pthread_mutex_t defer_lock = PTHREAD_MUTEX_INITIALIZER;
 
-int ip_defer_push(in_addr_t dst, uint8_t proto,
-                  const uint8_t * buf, size_t bsize)
+static struct {
+    unsigned long queued;
+    unsigned long sent;
+    unsigned long dropped;
+} defer_stats;
+
+static struct ip_defer_neigh * ip_defer_neigh_find(in_addr_t nexthop)
+{
+    for (size_t i = 0; i < num_elem(defer_neigh); i++) {
+        if (defer_neigh[i].nexthop == nexthop) {
+            return &defer_neigh[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void ip_defer_free(struct ip_defer * pkt)
 {
-    const size_t next = (q_wr + 1) % num_elem(ip_defer_queue);
-    struct ip_defer * slot;
+    struct ip_defer_chunk * chunk = pkt->chunks;
+
+    while (chunk) {
+        struct ip_defer_chunk * next = chunk->next;
 
-    if (defer_inhibit) {
-        return -EALREADY;
+        chunk->next = defer_chunk_free;
+        defer_chunk_free = chunk;
+        chunk = next;
     }
+    pkt->chunks = NULL;
+    STAILQ_INSERT_HEAD(&defer_pkt_free, pkt, link);
+}
 
-    if (next == q_rd) {
-        return -ENOBUFS;
+static struct ip_defer * ip_defer_alloc(size_t bsize)
+{
+    struct ip_defer * pkt;
+    struct ip_defer_chunk ** link;
+
+    pkt = STAILQ_FIRST(&defer_pkt_free);
+    if (!pkt) {
+        return NULL;
     }
-    slot = ip_defer_queue + q_wr;
+    STAILQ_REMOVE_HEAD(&defer_pkt_free, link);
+    pkt->chunks = NULL;
+    pkt->buf_size = bsize;
 
-    if (bsize > ETHER_ALEN) {
-        return -EMSGSIZE;
+    link = &pkt->chunks;
+    for (size_t n = 0; n < bsize; n += IP_DEFER_CHUNK_SIZE) {
+        struct ip_defer_chunk * chunk = defer_chunk_free;
+
+        if (!chunk) {
+            ip_defer_free(pkt);
+            return NULL;
+        }
+        defer_chunk_free = chunk->next;
+        chunk->next = NULL;
+        *link = chunk;
+        link = &chunk->next;
     }
 
-    slot->tries = 0;
-    slot->dst = dst;
-    slot->proto = proto;
-    memcpy(slot->buf, buf, bsize);
+    return pkt;
+}
 
-    q_wr = next;
-    return 0;
+/**
+ * Gather the data of iov to the chunks of pkt.
+ */
+static void ip_defer_copy_in(struct ip_defer * pkt, const struct iovec * iov,
+                             int iovcnt)
+{
+    struct ip_defer_chunk * chunk = pkt->chunks;
+    size_t chunk_off = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        const uint8_t * src = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+
+        while (left > 0) {
+            const size_t n = smin(left, IP_DEFER_CHUNK_SIZE - chunk_off);
+
+            memcpy(chunk->data + chunk_off, src, n);
+            src += n;
+            left -= n;
+            chunk_off += n;
+            if (chunk_off == IP_DEFER_CHUNK_SIZE) {
+                chunk = chunk->next;
+                chunk_off = 0;
+            }
+        }
+    }
 }
 
-static struct ip_defer * ip_defer_peek(void)
+/**
+ * Describe the chunks of pkt with an iovec.
+ * @returns the number of iovec entries used.
+ */
+static int ip_defer_iov(const struct ip_defer * pkt, struct iovec * iov)
 {
-    if (q_rd == q_wr) {
-        return NULL;
+    const struct ip_defer_chunk * chunk = pkt->chunks;
+    int iovcnt = 0;
+
+    for (size_t off = 0; off < pkt->buf_size; off += IP_DEFER_CHUNK_SIZE) {
+        iov[iovcnt++] = (struct iovec){
+            .iov_base = (void *)chunk->data,
+            .iov_len = smin(pkt->buf_size - off, IP_DEFER_CHUNK_SIZE),
+        };
+        chunk = chunk->next;
     }
 
-    return ip_defer_queue + q_rd;
+    return iovcnt;
 }
 
-static void ip_defer_drop(void)
+/**
+ * Drop all packets of a queue and release the queue.
+ * @returns the number of packets dropped.
+ */
+static unsigned long ip_defer_neigh_drop(struct ip_defer_neigh * neigh)
 {
-    if (q_rd == q_wr) {
-        return;
+    unsigned long n = 0;
+    struct ip_defer * pkt;
+
+    while ((pkt = STAILQ_FIRST(&neigh->queue))) {
+        STAILQ_REMOVE_HEAD(&neigh->queue, link);
+        ip_defer_free(pkt);
+        n++;
     }
+    neigh->nexthop = 0;
+    neigh->bytes = 0;
+    defer_stats.dropped += n;
+
+    return n;
+}
 
-    q_rd = (q_rd + 1) % num_elem(ip_defer_queue);
+int ip_defer_push(in_addr_t nexthop, in_addr_t dst, uint8_t proto,
+                  const uint8_t * buf, size_t bsize)
+{
+    const struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = bsize,
+    };
+
+    return ip_defer_pushv(nexthop, dst, proto, &iov, 1);
 }
 
-void ip_defer_handler(int delta_time __unused)
+int ip_defer_pushv(in_addr_t nexthop, in_addr_t dst, uint8_t proto,
+                   const struct iovec * iov, int iovcnt)
 {
-    defer_inhibit = 1;
-    while (1) {
-        struct ip_defer * ipd = ip_defer_peek();
-        if (!ipd) {
-            return;
+    struct ip_defer_neigh * neigh;
+    struct ip_defer * pkt = NULL;
+    size_t bsize = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        bsize += iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&defer_lock);
+
+    neigh = ip_defer_neigh_find(nexthop);
+    if (!neigh && (neigh = ip_defer_neigh_find(0))) {
+        neigh->nexthop = nexthop;
+        neigh->age = 0;
+        neigh->bytes = 0;
+        STAILQ_INIT(&neigh->queue);
+    }
+
+    if (neigh && neigh->bytes + bsize <= XSTACK_IP_DEFER_NEIGH_BYTES) {
+        pkt = ip_defer_alloc(bsize);
+    }
+    if (!pkt) {
+        defer_stats.dropped++;
+        if (neigh && STAILQ_EMPTY(&neigh->queue)) {
+            neigh->nexthop = 0;
         }
+        pthread_mutex_unlock(&defer_lock);
+        return -ENOBUFS;
+    }
+
+    pkt->dst = dst;
+    pkt->proto = proto;
+    ip_defer_copy_in(pkt, iov, iovcnt);
+    STAILQ_INSERT_TAIL(&neigh->queue, pkt, link);
+    neigh->bytes += bsize;
+    defer_stats.queued++;
+
+    pthread_mutex_unlock(&defer_lock);
+    return 0;
+}
+
+void ip_defer_flush(in_addr_t nexthop)
+{
+    struct ip_defer_neigh * neigh;
+    struct ip_defer_queue queue;
+
+    pthread_mutex_lock(&defer_lock);
+    neigh = ip_defer_neigh_find(nexthop);
+    if (!neigh || nexthop == 0) {
+        pthread_mutex_unlock(&defer_lock);
+        return;
+    }
+    STAILQ_INIT(&queue);
+    STAILQ_CONCAT(&queue, &neigh->queue);
+    neigh->nexthop = 0;
+    neigh->bytes = 0;
+    pthread_mutex_unlock(&defer_lock);
+
+    /*
+     * The packets are sent in the order they were deferred. The queue is
+     * private now so the packets are sent straight from their chunks and
+     * only freed afterwards.
+     */
+    while (!STAILQ_EMPTY(&queue)) {
+        struct ip_defer * pkt = STAILQ_FIRST(&queue);
+        struct iovec iov[IP_DEFER_IOV_MAX];
+        int iovcnt;
+
+        STAILQ_REMOVE_HEAD(&queue, link);
+        iovcnt = ip_defer_iov(pkt, iov);
+        ip_sendv(pkt->dst, pkt->proto, iov, iovcnt);
+
+        pthread_mutex_lock(&defer_lock);
+        ip_defer_free(pkt);
+        defer_stats.sent++;
+        pthread_mutex_unlock(&defer_lock);
+    }
+}
+
+void ip_defer_drop(in_addr_t nexthop)
+{
+    struct ip_defer_neigh * neigh;
+
+    pthread_mutex_lock(&defer_lock);
+    neigh = ip_defer_neigh_find(nexthop);
+    if (neigh && nexthop != 0) {
+        char str_ip[IP_STR_LEN];
+        unsigned long n;
+
+        n = ip_defer_neigh_drop(neigh);
+        ip2str(nexthop, str_ip);
+        LOG(LOG_INFO, "Dropped %lu deferred packets for %s (total %lu)",
+            n, str_ip, defer_stats.dropped);
+    }
+    pthread_mutex_unlock(&defer_lock);
+}
 
-        if (ipd->tries++ > 3) { /* Drop the packet after couple of tries. */
-            char str_ip[IP_STR_LEN];
+/**
+ * Drop packets that have been waiting for too long.
+ * The queue is normally flushed or dropped by ARP but a resolution can be
+ * also lost, for example if the cache entry is evicted.
+ */
+static void ip_defer_handler(int delta_time)
+{
+    pthread_mutex_lock(&defer_lock);
+    for (size_t i = 0; i < num_elem(defer_neigh); i++) {
+        struct ip_defer_neigh * neigh = &defer_neigh[i];
 
-            ip2str(ipd->dst, str_ip);
-            LOG(LOG_INFO, "Dropping IP deferred transmission for %s", str_ip);
-            ip_defer_drop();
+        if (neigh->nexthop == 0) {
             continue;
         }
+        neigh->age += delta_time;
+        if (neigh->age > IP_DEFER_AGE_MAX) {
+            unsigned long n;
 
-        if (ip_send(ipd->dst, ipd->proto, ipd->buf, ipd->buf_size) == -1) {
-            if (errno == EHOSTUNREACH) {
-                ipd->tries++; /* Try again later. */
-                return;
-            }
+            n = ip_defer_neigh_drop(neigh);
+            LOG(LOG_INFO, "Dropped %lu expired deferred packets (total %lu)",
+                n, defer_stats.dropped);
         }
-        ip_defer_drop();
     }
-    defer_inhibit = 0;
+    pthread_mutex_unlock(&defer_lock);
 }
 XSTACK_PERIODIC_TASK(ip_defer_handler);
+
+__constructor void ip_defer_init(void)
+{
+    STAILQ_INIT(&defer_pkt_free);
+    for (size_t i = 0; i < num_elem(defer_pkts); i++) {
+        STAILQ_INSERT_TAIL(&defer_pkt_free, &defer_pkts[i], link);
+    }
+    for (size_t i = 0; i < num_elem(defer_chunks); i++) {
+        defer_chunks[i].next = defer_chunk_free;
+        defer_chunk_free = &defer_chunks[i];
+    }
+}
@@ -2,18 +2,50 @@
  * @addtogroup ip_defer
  * IP defer can be used to defer IP packet transmission processing.
  * This is useful for example while waiting for an ARP reply.
+ * Deferred packets are queued per next hop and sent in order as soon as the
+ * link address of the next hop is known.
  * @{
  */
 
 #ifndef IP_DEFER_H
 #define IP_DEFER_H
 
+#include <sys/uio.h>
+
 #include "xstack_in.h"
 
-int ip_defer_push(in_addr_t dst, uint8_t proto,
+/**
+ * Defer a packet until the link address of nexthop is resolved.
+ * @param nexthop is the address being resolved.
+ * @param dst is the final destination of the packet.
+ * @returns 0 if the packet was queued;
+ *          -ENOBUFS if the queue of nexthop or the buffer store is full.
+ */
+int ip_defer_push(in_addr_t nexthop, in_addr_t dst, uint8_t proto,
                   const uint8_t * buf, size_t bsize);
 
-void ip_defer_handler(int delta_time);
+/**
+ * Defer a packet gathered from iov until the link address of nexthop is
+ * resolved.
+ * The data is gathered directly to the buffer store.
+ * @param nexthop is the address being resolved.
+ * @param dst is the final destination of the packet.
+ * @returns 0 if the packet was queued;
+ *          -ENOBUFS if the queue of nexthop or the buffer store is full.
+ */
+int ip_defer_pushv(in_addr_t nexthop, in_addr_t dst, uint8_t proto,
+                   const struct iovec * iov, int iovcnt);
+
+/**
+ * Send the packets deferred for nexthop.
+ * Must not be called while holding the ARP cache lock or a transmit buffer.
+ */
+void ip_defer_flush(in_addr_t nexthop);
+
+/**
+ * Drop the packets deferred for nexthop.
+ */
+void ip_defer_drop(in_addr_t nexthop);
 
 #endif /* IP_DEFER_H */
 
@@ -0,0 +1,68 @@
+#include <errno.h>
+#include <string.h>
+
+#include "xstack_util.h"
+
+#include "ip_dst.h"
+#include "ip_pmtu.h"
+#include "xstack_arp.h"
+#include "xstack_ether.h"
+#include "xstack_ip.h"
+
+static __thread struct ip_dst ip_dst_cache[XSTACK_IP_DST_CACHE_SIZE];
+
+static inline size_t ip_dst_hash(in_addr_t dst)
+{
+    return (dst * 0x9e3779b1u) >> 16 & (num_elem(ip_dst_cache) - 1);
+}
+
+struct ip_dst * ip_dst_get(in_addr_t dst)
+{
+    struct ip_dst * entry = &ip_dst_cache[ip_dst_hash(dst)];
+    const unsigned route_gen = ip_route_generation();
+    const unsigned pmtu_gen = ip_pmtu_generation();
+    struct ip_route route;
+
+    /* A generation is never 0 so an unused entry never matches. */
+    if (entry->dst == dst && entry->route_gen == route_gen) {
+        if (entry->pmtu_gen != pmtu_gen) {
+            entry->mtu = ip_pmtu_get(dst, ETHER_DATA_LEN, &entry->df);
+            entry->pmtu_gen = pmtu_gen;
+        }
+        return entry;
+    }
+
+    if (ip_route_find_by_network(dst, &route)) {
+        return NULL;
+    }
+
+    entry->dst = dst;
+    entry->src = route.r_iface;
+    entry->nexthop = (route.r_gw) ? route.r_gw : dst;
+    entry->ether_handle = route.r_iface_handle;
+    entry->mtu = ip_pmtu_get(dst, ETHER_DATA_LEN, &entry->df);
+    entry->pmtu_gen = pmtu_gen;
+    entry->haddr_valid = 0;
+    entry->route_gen = route_gen;
+
+    return entry;
+}
+
+int ip_dst_resolve(struct ip_dst * entry)
+{
+    /* Read the generation first so a concurrent change invalidates haddr. */
+    const unsigned arp_gen = arp_cache_generation();
+
+    if (entry->haddr_valid && entry->arp_gen == arp_gen) {
+        return 0;
+    }
+
+    if (arp_cache_get_haddr(entry->src, entry->nexthop, entry->haddr)) {
+        entry->haddr_valid = 0;
+        return -1;
+    }
+    entry->haddr_valid = 1;
+    entry->arp_gen = arp_gen;
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * @addtogroup ip_dst
+ * IP destination cache.
+ * The destination cache remembers the route and the link address of recently
+ * used destinations so that sending to the same destination again doesn't
+ * need any table lookups. Each thread has its own cache and an entry is
+ * revalidated against the route, path MTU and ARP cache generation counters
+ * on every use.
+ * @{
+ */
+
+#ifndef IP_DST_H
+#define IP_DST_H
+
+#include "xstack_in.h"
+#include "xstack_link.h"
+
+/**
+ * A destination cache entry.
+ */
+struct ip_dst {
+    in_addr_t dst;          /*!< Destination address. */
+    in_addr_t src;          /*!< Source address, the interface address. */
+    in_addr_t nexthop;      /*!< The destination itself or a gateway. */
+    int ether_handle;       /*!< Interface ether_handle. */
+    size_t mtu;             /*!< MTU towards the destination. */
+    int df;                 /*!< Set DF on packets that fit in mtu. */
+    mac_addr_t haddr;       /*!< Link address of the next hop. */
+    int haddr_valid;        /*!< Set if haddr is resolved. */
+    unsigned route_gen;     /*!< Route generation of the entry. */
+    unsigned arp_gen;       /*!< ARP generation of haddr. */
+    unsigned pmtu_gen;      /*!< Path MTU generation of mtu. */
+};
+
+/**
+ * Get a destination cache entry.
+ * The returned entry is valid until the next call from the same thread.
+ * @returns a pointer to the entry;
+ *          NULL if there is no route to the destination, errno is set.
+ */
+struct ip_dst * ip_dst_get(in_addr_t dst);
+
+/**
+ * Resolve the link address of the next hop towards a destination.
+ * All destinations behind the same gateway share its ARP cache entry.
+ * @retval 0 haddr is valid;
+ * @retval -1 the address is not resolved yet, errno is set to EHOSTUNREACH
+ *            if a resolution is in progress.
+ */
+int ip_dst_resolve(struct ip_dst * entry);
+
+#endif /* IP_DST_H */
+
+/**
+ * @}
+ */
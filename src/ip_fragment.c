@@ -1,223 +1,457 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "xstack_in.h"
+#include "xstack_util.h"
 
 #include "logger.h"
+#include "queue.h"
+#include "timer.h"
 #include "tree.h"
 #include "xstack_ip.h"
 
-#define FRAG_MAX 8192
-#define FRAG_MAP_SIZE (FRAG_MAX / 32)
-#define FRAG_MAP_AI(_i_) ((_i_) >> 5)
-#define FRAG_MAP_BI(_i_) ((_i_) & 0x1f)
+#define FRAG_HDR_MAX 60         /* Max IP header length. */
+#define FRAG_HOLE_NONE 0xffff   /* End of the hole list. */
 
-struct fragment_map {
-    uint32_t fragmap[FRAG_MAP_SIZE];
+/**
+ * A hole descriptor (RFC 815).
+ * The descriptors are stored in the holes themselves, the holes are at
+ * least 8 bytes as all fragments but the last one are multiples of 8.
+ */
+struct fragment_hole {
+    uint16_t first;             /*!< Payload offset of the hole. */
+    uint16_t last;              /*!< Last byte of the hole, inclusive. */
+    uint16_t next;              /*!< Offset of the next hole. */
 };
 
+/**
+ * A datagram being reassembled.
+ * The buffer has room for the header of the first fragment in front of the
+ * payload so that the reassembled datagram is contiguous.
+ */
 struct packet_buf {
-    int reserved;
-    int timer;
-    struct fragment_map fragmap;
-    struct ip_hdr ip_hdr;
-    uint8_t payload[IP_MAX_BYTES];
+    /* Bufid according to RFC 791. */
+    in_addr_t src;
+    in_addr_t dst;
+    uint16_t id;
+    uint8_t proto;
+
+    uint16_t holes;     /*!< Offset of the first hole. */
+    /**
+     * Start of the hole after the data received so far, it's open ended
+     * until the last fragment is received and not stored in the buffer.
+     */
+    uint16_t tail;
+    size_t hlen;        /*!< Header length, 0 until the first fragment. */
+    size_t total;       /*!< Payload length, 0 until the last fragment. */
+    size_t size;        /*!< Allocated payload length. */
+    uint64_t expires;   /*!< Given up at [ms]. */
+    uint8_t * buf;
     RB_ENTRY(packet_buf) _entry;
+    TAILQ_ENTRY(packet_buf) _age_entry;
 };
 
 RB_HEAD(packet_buf_tree, packet_buf);
-
-static struct packet_buf packet_buffer[4];
-static struct packet_buf_tree packet_buffer_head = RB_INITIALIZER();
+TAILQ_HEAD(packet_buf_ageq, packet_buf);
 
 /*
- * TODO Timer for giving up
+ * The datagrams are kept in the tree for the lookup and in the age queue
+ * in the order of arrival, which is also the order of expiration. All
+ * protected by packet_buf_lock.
  */
+static struct packet_buf_tree packet_buffer_head = RB_INITIALIZER();
+static struct packet_buf_ageq packet_buf_ageq =
+    TAILQ_HEAD_INITIALIZER(packet_buf_ageq);
+static size_t packet_buf_nr;
+static size_t packet_buf_mem; /*!< Bytes allocated for the reassembly. */
+static struct timer packet_buf_timer;
+static pthread_mutex_t packet_buf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    unsigned long reassembled;
+    unsigned long timeouts;
+    unsigned long dropped;
+} frag_stats;
 
 static int packet_buf_cmp(struct packet_buf * a, struct packet_buf * b)
 {
-    /* Bufid according to RFC 791 */
-    struct bufid {
-        typeof(a->ip_hdr.ip_src) src;
-        typeof(a->ip_hdr.ip_dst) dst;
-        typeof(a->ip_hdr.ip_proto) proto;
-        typeof(a->ip_hdr.ip_id) id;
-    } bufid[2];
-
-    memset(bufid, 0, sizeof(bufid));
-
-    bufid[0] = (struct bufid){
-        .src =      a->ip_hdr.ip_src,
-        .dst =      a->ip_hdr.ip_dst,
-        .proto =    a->ip_hdr.ip_proto,
-        .id =       a->ip_hdr.ip_id,
-    };
-    bufid[1] = (struct bufid){
-        .src =      b->ip_hdr.ip_src,
-        .dst =      b->ip_hdr.ip_dst,
-        .proto =    b->ip_hdr.ip_proto,
-        .id =       b->ip_hdr.ip_id,
-    };
-
-    return memcmp(&bufid[0], &bufid[1], sizeof(struct bufid));
+    if (a->src != b->src) {
+        return (a->src < b->src) ? -1 : 1;
+    }
+    if (a->dst != b->dst) {
+        return (a->dst < b->dst) ? -1 : 1;
+    }
+    if (a->id != b->id) {
+        return (a->id < b->id) ? -1 : 1;
+    }
+    if (a->proto != b->proto) {
+        return (a->proto < b->proto) ? -1 : 1;
+    }
+    return 0;
 }
 
 RB_GENERATE_STATIC(packet_buf_tree, packet_buf, _entry, packet_buf_cmp);
 
-static inline void fragmap_init(struct fragment_map * map)
+static inline size_t packet_buf_memsize(size_t size)
 {
-    memset(map->fragmap, 0, FRAG_MAP_SIZE);
+    return sizeof(struct packet_buf) + FRAG_HDR_MAX + size;
 }
 
-static inline void fragmap_set(struct fragment_map * map, unsigned i)
+static void packet_buf_free(struct packet_buf * p)
 {
-    map->fragmap[FRAG_MAP_AI(i)] |= 1 << FRAG_MAP_BI(i);
+    RB_REMOVE(packet_buf_tree, &packet_buffer_head, p);
+    TAILQ_REMOVE(&packet_buf_ageq, p, _age_entry);
+    packet_buf_nr--;
+    packet_buf_mem -= packet_buf_memsize(p->size);
+    free(p->buf);
+    free(p);
 }
 
-static inline void fragmap_clear(struct fragment_map * map, unsigned i)
+/**
+ * Free the oldest datagram to make room for new fragments.
+ * @returns 0 if a datagram was freed; -1 if there is nothing to free.
+ */
+static int packet_buf_evict(const struct packet_buf * keep)
 {
-    map->fragmap[FRAG_MAP_AI(i)] &= ~(1 << FRAG_MAP_BI(i));
-}
+    struct packet_buf * p = TAILQ_FIRST(&packet_buf_ageq);
 
-static inline int fragmap_tst(struct fragment_map * map, unsigned i)
-{
-    return (map->fragmap[FRAG_MAP_AI(i)] & (1 << FRAG_MAP_BI(i)));
+    if (!p || p == keep) {
+        return -1;
+    }
+
+    packet_buf_free(p);
+    frag_stats.dropped++;
+
+    return 0;
 }
 
-static inline void release_packet_buffer(struct packet_buf * p)
+/**
+ * Resize the payload buffer of a datagram within the memory limit.
+ */
+static int packet_buf_resize(struct packet_buf * p, size_t size)
 {
-    RB_REMOVE(packet_buf_tree, &packet_buffer_head, p);
-    __sync_lock_release(&p->reserved);
+    uint8_t * buf;
+
+    while (packet_buf_mem - packet_buf_memsize(p->size) +
+           packet_buf_memsize(size) > XSTACK_IP_FRAGMENT_MEM) {
+        if (packet_buf_evict(p)) {
+            return -1;
+        }
+    }
+
+    buf = realloc(p->buf, FRAG_HDR_MAX + size);
+    if (!buf) {
+        return -1;
+    }
+
+    packet_buf_mem += packet_buf_memsize(size) - packet_buf_memsize(p->size);
+    p->buf = buf;
+    p->size = size;
+
+    return 0;
 }
 
-struct packet_buf * get_packet_buffer(struct ip_hdr * hdr)
+static struct packet_buf * get_packet_buffer(const struct ip_hdr * hdr)
 {
     struct packet_buf find = {
-        .ip_hdr.ip_id = hdr->ip_id,
-        .ip_hdr.ip_proto = hdr->ip_proto,
-        .ip_hdr.ip_src = hdr->ip_src,
-        .ip_hdr.ip_dst = hdr->ip_dst,
+        .src = hdr->ip_src,
+        .dst = hdr->ip_dst,
+        .id = hdr->ip_id,
+        .proto = hdr->ip_proto,
     };
     struct packet_buf * p;
-    size_t i;
 
-    /*
-     * Try to find it.
-     */
     p = RB_FIND(packet_buf_tree, &packet_buffer_head, &find);
     if (p) {
         return p;
     }
 
-    /*
-     * Not yet allocated, so allocate a new buffer.
-     */
-    for (i = 0; i < num_elem(packet_buffer); i++) {
-        struct packet_buf * p = packet_buffer + i;
-        const int old = __sync_lock_test_and_set(&p->reserved, 1);
+    while (packet_buf_nr >= XSTACK_IP_FRAGMENT_BUF ||
+           packet_buf_mem + packet_buf_memsize(0) > XSTACK_IP_FRAGMENT_MEM) {
+        if (packet_buf_evict(NULL)) {
+            return NULL;
+        }
+    }
 
-        if (old == 0) {
-            fragmap_init(&p->fragmap);
-            p->timer = XSTACK_IP_FRAGMENT_TLB;
-            p->ip_hdr = *hdr; /* RFE Clear things that aren't needed. */
-            p->ip_hdr.ip_foff = 0;
-            p->ip_hdr.ip_len = 0;
+    p = malloc(sizeof(struct packet_buf));
+    if (!p) {
+        return NULL;
+    }
+    *p = find;
+    p->holes = FRAG_HOLE_NONE;
+    p->tail = 0;
+    p->expires = timer_now() + XSTACK_IP_FRAGMENT_TLB * 1000;
+
+    RB_INSERT(packet_buf_tree, &packet_buffer_head, p);
+    TAILQ_INSERT_TAIL(&packet_buf_ageq, p, _age_entry);
+    packet_buf_nr++;
+    packet_buf_mem += packet_buf_memsize(0);
+
+    if (!timer_pending(&packet_buf_timer)) {
+        timer_arm(&packet_buf_timer, XSTACK_IP_FRAGMENT_TLB * 1000);
+    }
 
-            if (RB_INSERT(packet_buf_tree, &packet_buffer_head, p)) {
-                release_packet_buffer(p);
+    return p;
+}
 
-                return NULL;
-            }
+static inline uint8_t * packet_buf_payload(struct packet_buf * p)
+{
+    return p->buf + FRAG_HDR_MAX;
+}
 
-            return p;
+static void hole_get(struct packet_buf * p, unsigned off,
+                     struct fragment_hole * hole)
+{
+    memcpy(hole, packet_buf_payload(p) + off, sizeof(*hole));
+}
+
+static void hole_put(struct packet_buf * p, const struct fragment_hole * hole)
+{
+    memcpy(packet_buf_payload(p) + hole->first, hole, sizeof(*hole));
+}
+
+/**
+ * Point the hole prev, or the head of the list, to the hole at off.
+ */
+static void hole_link(struct packet_buf * p, unsigned prev, unsigned off)
+{
+    struct fragment_hole hole;
+
+    if (prev == FRAG_HOLE_NONE) {
+        p->holes = off;
+        return;
+    }
+    hole_get(p, prev, &hole);
+    hole.next = off;
+    hole_put(p, &hole);
+}
+
+/**
+ * Fill the holes covered by a fragment of the payload [first, last].
+ * The buffer must already cover the fragment.
+ */
+static void packet_buf_fill(struct packet_buf * p, unsigned first,
+                            unsigned last, int more)
+{
+    unsigned prev = FRAG_HOLE_NONE;
+    unsigned off;
+
+    if (p->tail != FRAG_HOLE_NONE && last >= p->tail) {
+        if (first > p->tail) {
+            const struct fragment_hole hole = {
+                .first = p->tail,
+                .last = first - 1,
+                .next = p->holes,
+            };
+
+            hole_put(p, &hole);
+            p->holes = hole.first;
         }
+        p->tail = (more) ? last + 1 : FRAG_HOLE_NONE;
+    } else if (!more) {
+        p->tail = FRAG_HOLE_NONE;
     }
 
-    return NULL;
+    for (off = p->holes; off != FRAG_HOLE_NONE;) {
+        struct fragment_hole hole;
+        unsigned next;
+
+        hole_get(p, off, &hole);
+        next = hole.next;
+        if (first > hole.last || last < hole.first) {
+            prev = off;
+            off = next;
+            continue;
+        }
+
+        /* Replace the hole with what remains of it on either side. */
+        hole_link(p, prev, next);
+        if (first > hole.first) {
+            const struct fragment_hole new = {
+                .first = hole.first,
+                .last = first - 1,
+                .next = next,
+            };
+
+            hole_put(p, &new);
+            hole_link(p, prev, new.first);
+            prev = new.first;
+        }
+        if (last < hole.last) {
+            const struct fragment_hole new = {
+                .first = last + 1,
+                .last = hole.last,
+                .next = next,
+            };
+
+            hole_put(p, &new);
+            hole_link(p, prev, new.first);
+            prev = new.first;
+        }
+        off = next;
+    }
 }
 
-int ip_fragment_input(struct ip_hdr * ip_hdr, uint8_t * rx_packet)
+/**
+ * Add a fragment to a datagram.
+ * @returns 0 if the fragment was added; -1 if the datagram must be dropped.
+ */
+static int packet_buf_add(struct packet_buf * p, const struct ip_hdr * ip_hdr,
+                          const uint8_t * payload)
 {
+    const size_t hlen = ip_hdr_hlen(ip_hdr);
     const size_t off = (ip_hdr->ip_foff & 0x1fff) << 3;
-    struct packet_buf * p;
-    size_t i;
+    const size_t len = ip_hdr->ip_len - hlen;
+    const int more = !!(ip_hdr->ip_foff & IP_FLAGS_MF);
+    const size_t end = off + len;
 
-    if (off > IP_MAX_BYTES) {
-        return -EMSGSIZE;
+    /* Only the last fragment may have a length that isn't a multiple of 8. */
+    if (len == 0 || (more && (len & 7)) || end + hlen > IP_MAX_BYTES) {
+        return -1;
     }
 
-    p = get_packet_buffer(ip_hdr);
-    if (!p) {
-        LOG(LOG_WARN, "Out of fragment buffers");
-        return -ENOBUFS;
+    /*
+     * Must agree with the length given by the last fragment and no data
+     * may have been received past the end.
+     */
+    if (p->total && (end > p->total || (!more && end != p->total))) {
+        return -1;
+    }
+    if (!more && p->tail != FRAG_HOLE_NONE && p->tail > end) {
+        return -1;
     }
+    if (!more) {
+        p->total = end;
+    }
+
+    if (end > p->size) {
+        size_t size = (p->total) ? p->total : min(2 * p->size, IP_MAX_BYTES);
 
-    memcpy(p->payload + off, rx_packet,
-           ip_hdr->ip_len - ip_hdr_hlen(ip_hdr));
-    for (i = off >> 3; i < (off >> 3) + ((ip_hdr->ip_len -
-                                         ip_hdr_hlen(ip_hdr) + 7) >> 3);
-         i++) {
-        fragmap_set(&p->fragmap, i);
+        if (packet_buf_resize(p, (size > end) ? size : end)) {
+            return -1;
+        }
     }
 
+    packet_buf_fill(p, off, end - 1, more);
+    memcpy(packet_buf_payload(p) + off, payload, len);
     if (off == 0) {
-        p->ip_hdr = *ip_hdr;
-        p->ip_hdr.ip_len = 0;
-        p->ip_hdr.ip_foff = 0;
-    } else if (!(ip_hdr->ip_foff & IP_FLAGS_MF)) {
-        p->ip_hdr.ip_len = ip_hdr->ip_len - ip_hdr_hlen(ip_hdr) + off;
+        memcpy(p->buf + FRAG_HDR_MAX - hlen, ip_hdr, hlen);
+        p->hlen = hlen;
     }
 
-    if (p->ip_hdr.ip_len != 0) {
-        int t = 0;
+    return 0;
+}
 
-        for (i = 0; i < (size_t)((p->ip_hdr.ip_len + 7) >> 3); i++) {
-            t |= !fragmap_tst(&p->fragmap, i);
-        }
-        if (!t) {
-            int retval;
+/**
+ * Pass a reassembled datagram to the IP input and send a reply if there is
+ * one.
+ */
+static void packet_buf_input(struct packet_buf * p)
+{
+    struct ip_hdr * hdr = (struct ip_hdr *)(p->buf + FRAG_HDR_MAX - p->hlen);
+    uint8_t net[FRAG_HDR_MAX];
+    int retval;
 
-            LOG(LOG_DEBUG, "Fragmented packet was fully reassembled (len: %u)",
-                (unsigned)p->ip_hdr.ip_len);
-            retval = ip_input(NULL, (uint8_t *)(&p->ip_hdr), p->ip_hdr.ip_len);
+    LOG(LOG_DEBUG, "Fragmented packet was fully reassembled (len: %u)",
+        (unsigned)p->total);
 
-            ip_ntoh(&p->ip_hdr, &p->ip_hdr);
-            retval = ip_send(p->ip_hdr.ip_dst, p->ip_hdr.ip_proto,
-                             p->payload, retval);
-            if (retval < 0) {
-                LOG(LOG_ERR, "Failed to send fragments");
-            }
+    hdr->ip_len = p->hlen + p->total;
+    hdr->ip_foff = 0;
 
-            release_packet_buffer(p);
+    /*
+     * The header is in host order but the checksum must be valid for the
+     * network order header, a reply header is patched incrementally.
+     */
+    memcpy(net, hdr, p->hlen);
+    ip_hton(hdr, (struct ip_hdr *)net);
+    hdr->ip_csum = ((struct ip_hdr *)net)->ip_csum;
+
+    retval = ip_input(NULL, (uint8_t *)hdr, hdr->ip_len, 0);
+    if (retval > 0) {
+        /* The reply was built in place, in network order. */
+        const size_t hlen = ip_hdr_hlen(hdr);
+
+        retval = ip_send(ntohl(hdr->ip_dst), hdr->ip_proto,
+                         (uint8_t *)hdr + hlen, retval - hlen);
+        if (retval < 0) {
+            LOG(LOG_ERR, "Failed to send a reply to a reassembled packet");
         }
     }
+}
 
-    /*
-     * Commenting out this line breaks the RFC but greatly reduces DOS
-     * possibilities againts the fragment reassembly implementation.
-     */
-#if 0
-    p->timer = imax(ip->ip_hdr.ip_ttl, p->timer);
-#endif
+int ip_fragment_input(struct ip_hdr * ip_hdr, uint8_t * rx_packet)
+{
+    struct packet_buf * p;
+
+    pthread_mutex_lock(&packet_buf_lock);
+
+    p = get_packet_buffer(ip_hdr);
+    if (!p) {
+        frag_stats.dropped++;
+        pthread_mutex_unlock(&packet_buf_lock);
+        LOG(LOG_WARN, "Out of fragment buffers");
+        return -ENOBUFS;
+    }
+
+    if (packet_buf_add(p, ip_hdr, rx_packet)) {
+        packet_buf_free(p);
+        frag_stats.dropped++;
+        pthread_mutex_unlock(&packet_buf_lock);
+        LOG(LOG_WARN, "Dropped an invalid fragmented packet");
+        return -EINVAL;
+    }
+
+    if (p->holes != FRAG_HOLE_NONE || p->tail != FRAG_HOLE_NONE) {
+        pthread_mutex_unlock(&packet_buf_lock);
+        return 0;
+    }
+
+    /* Complete, the buffer is processed outside of the lock. */
+    RB_REMOVE(packet_buf_tree, &packet_buffer_head, p);
+    TAILQ_REMOVE(&packet_buf_ageq, p, _age_entry);
+    packet_buf_nr--;
+    packet_buf_mem -= packet_buf_memsize(p->size);
+    frag_stats.reassembled++;
+    pthread_mutex_unlock(&packet_buf_lock);
+
+    packet_buf_input(p);
+    free(p->buf);
+    free(p);
 
     return 0;
 }
 
-void ip_fragment_timer(int delta_time)
+/**
+ * Give up reassembling datagrams that didn't complete in time.
+ * RFC 791 would extend the timer by the TTL of each fragment but that makes
+ * denial of service attacks against the reassembly easier.
+ */
+static void ip_fragment_timer(struct timer * timer)
 {
-    size_t i;
-    for (i = 0; i < num_elem(packet_buffer); i++) {
-        struct packet_buf * p = &packet_buffer[i];
+    const uint64_t now = timer_now();
+    struct packet_buf * p;
 
-        /* TODO not actually as thread safe as the allocation. */
-        if (!p->reserved)
-            continue;
+    pthread_mutex_lock(&packet_buf_lock);
 
-        p->timer -= delta_time;
-        if (p->timer <= 0) {
-            release_packet_buffer(p);
-        }
+    while ((p = TAILQ_FIRST(&packet_buf_ageq)) && p->expires <= now) {
+        packet_buf_free(p);
+        frag_stats.timeouts++;
+        LOG(LOG_DEBUG,
+            "Reassembly timeout (reassembled: %lu timeouts: %lu dropped: %lu)",
+            frag_stats.reassembled, frag_stats.timeouts, frag_stats.dropped);
+    }
+    if (p) {
+        timer_arm(timer, p->expires - now);
     }
+
+    pthread_mutex_unlock(&packet_buf_lock);
+}
+
+__constructor void ip_fragment_init(void)
+{
+    timer_init(&packet_buf_timer, ip_fragment_timer);
 }
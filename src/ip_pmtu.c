@@ -0,0 +1,142 @@
+#include <pthread.h>
+#include <stddef.h>
+
+#include "xstack_in.h"
+#include "xstack_util.h"
+
+#include "ip_pmtu.h"
+#include "logger.h"
+#include "xstack_internal.h"
+#include "xstack_ip.h"
+
+/**
+ * A learned path MTU.
+ */
+struct ip_pmtu {
+    in_addr_t dst;          /*!< 0 if the entry is unused. */
+    size_t mtu;
+    int nodf;               /*!< The reported MTU was below the minimum. */
+    int age;                /*!< Time since the last update [s]. */
+};
+
+/*
+ * Only the paths with an MTU smaller than the link MTU are stored so the
+ * table is small and a linear search is sufficient.
+ */
+static struct ip_pmtu pmtu_table[XSTACK_IP_PMTU_SIZE];
+static pthread_mutex_t pmtu_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned pmtu_gen = 1; /*!< Incremented on changes, never 0. */
+
+static void pmtu_changed(void)
+{
+    if (__atomic_add_fetch(&pmtu_gen, 1, __ATOMIC_RELEASE) == 0) {
+        __atomic_store_n(&pmtu_gen, 1, __ATOMIC_RELEASE);
+    }
+}
+
+unsigned ip_pmtu_generation(void)
+{
+    return __atomic_load_n(&pmtu_gen, __ATOMIC_ACQUIRE);
+}
+
+static struct ip_pmtu * pmtu_find(in_addr_t dst)
+{
+    for (size_t i = 0; i < num_elem(pmtu_table); i++) {
+        if (pmtu_table[i].dst == dst) {
+            return &pmtu_table[i];
+        }
+    }
+
+    return NULL;
+}
+
+size_t ip_pmtu_get(in_addr_t dst, size_t mtu, int * df)
+{
+    struct ip_pmtu * entry;
+
+    *df = 1;
+    pthread_mutex_lock(&pmtu_lock);
+    entry = pmtu_find(dst);
+    if (entry && entry->mtu < mtu) {
+        mtu = entry->mtu;
+        *df = !entry->nodf;
+    }
+    pthread_mutex_unlock(&pmtu_lock);
+
+    return mtu;
+}
+
+void ip_pmtu_update(in_addr_t dst, size_t mtu)
+{
+    struct ip_pmtu * entry;
+    char str_ip[IP_STR_LEN];
+    int nodf = 0;
+
+    if (dst == 0) {
+        return;
+    }
+    if (mtu < XSTACK_IP_PMTU_MIN) {
+        /*
+         * Don't go below the minimum but stop setting DF, otherwise the
+         * path would be a black hole.
+         */
+        mtu = XSTACK_IP_PMTU_MIN;
+        nodf = 1;
+    }
+
+    pthread_mutex_lock(&pmtu_lock);
+
+    entry = pmtu_find(dst);
+    if (entry) {
+        if (mtu > entry->mtu || (mtu == entry->mtu && nodf <= entry->nodf)) {
+            goto out;
+        }
+    } else {
+        /* Replace the oldest entry if the table is full. */
+        entry = pmtu_find(0);
+        if (!entry) {
+            entry = &pmtu_table[0];
+            for (size_t i = 1; i < num_elem(pmtu_table); i++) {
+                if (pmtu_table[i].age > entry->age) {
+                    entry = &pmtu_table[i];
+                }
+            }
+        }
+        entry->dst = dst;
+    }
+    entry->mtu = mtu;
+    entry->nodf = nodf;
+    entry->age = 0;
+    pmtu_changed();
+
+    ip2str(dst, str_ip);
+    LOG(LOG_INFO, "Path MTU to %s is %u%s", str_ip, (unsigned)mtu,
+        (nodf) ? " without DF" : "");
+
+out:
+    pthread_mutex_unlock(&pmtu_lock);
+}
+
+static void ip_pmtu_expire(int delta_time)
+{
+    int changed = 0;
+
+    pthread_mutex_lock(&pmtu_lock);
+    for (size_t i = 0; i < num_elem(pmtu_table); i++) {
+        struct ip_pmtu * entry = &pmtu_table[i];
+
+        if (entry->dst == 0) {
+            continue;
+        }
+        entry->age += delta_time;
+        if (entry->age > XSTACK_IP_PMTU_AGE) {
+            entry->dst = 0;
+            changed = 1;
+        }
+    }
+    if (changed) {
+        pmtu_changed();
+    }
+    pthread_mutex_unlock(&pmtu_lock);
+}
+XSTACK_PERIODIC_TASK(ip_pmtu_expire);
@@ -0,0 +1,46 @@
+/**
+ * @addtogroup ip_pmtu
+ * IP path MTU discovery (RFC 1191).
+ * Packets that fit in the path MTU are sent with the DF flag set and the
+ * path MTU of a destination is lowered by the ICMP fragmentation needed
+ * messages received for it. A learned path MTU expires after
+ * XSTACK_IP_PMTU_AGE so that an increase of the path MTU is eventually
+ * detected.
+ * @{
+ */
+
+#ifndef IP_PMTU_H
+#define IP_PMTU_H
+
+#include <stddef.h>
+
+#include "xstack_in.h"
+
+/**
+ * Get the path MTU towards a destination.
+ * @param mtu is the MTU of the link towards the destination.
+ * @param[out] df is cleared if packets to the destination must be sent
+ *                without the DF flag; Otherwise it's set.
+ * @returns the path MTU, at most mtu.
+ */
+size_t ip_pmtu_get(in_addr_t dst, size_t mtu, int * df);
+
+/**
+ * Lower the path MTU of a destination.
+ * An increase is ignored and the MTU is never set below XSTACK_IP_PMTU_MIN.
+ * If a smaller MTU is reported the DF flag is no longer set for the
+ * destination so that routers can fragment the packets further (RFC 1191).
+ */
+void ip_pmtu_update(in_addr_t dst, size_t mtu);
+
+/**
+ * Get the current generation of the path MTU table.
+ * The generation changes whenever a path MTU changes or expires.
+ */
+unsigned ip_pmtu_generation(void);
+
+#endif /* IP_PMTU_H */
+
+/**
+ * @}
+ */
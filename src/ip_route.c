@@ -1,113 +1,280 @@
 #include <errno.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "xstack_util.h"
 
-#include "queue.h"
 #include "tree.h"
 #include "xstack_ip.h"
 
+#define RIB_PREFIX_MAX 32
+
 struct ip_route_entry {
     struct ip_route route;
-    RB_ENTRY(ip_route_entry) _rib_rtree_entry;          /*!< Network tree. */
     RB_ENTRY(ip_route_entry) _rib_stree_entry;          /*!< Source addr tree. */
-    SLIST_ENTRY(ip_route_entry) _rib_freelist_entry;
 };
 
-RB_HEAD(rib_routetree, ip_route_entry);
+/**
+ * A node of the path compressed binary trie (Patricia trie) used for the
+ * longest prefix match.
+ * A node either holds a route or it's a glue node with two children that
+ * only exists to fork the paths.
+ */
+struct rib_node {
+    in_addr_t prefix;               /*!< Prefix in host order. */
+    unsigned len;                   /*!< Prefix length in bits. */
+    struct ip_route_entry * entry;  /*!< The route or NULL for a glue node. */
+    struct rib_node * child[2];
+};
+
 RB_HEAD(rib_sourcetree, ip_route_entry);
-SLIST_HEAD(rib_freelist, ip_route_entry);
 
-static struct ip_route_entry rib[XSTACK_IP_RIB_SIZE];
-static struct rib_routetree rib_routetree;
+static struct rib_node * rib_root;
 static struct rib_sourcetree rib_sourcetree;
-static struct rib_freelist rib_freelist;
+static unsigned rib_gen = 1; /*!< Incremented on every change, never 0. */
 
 /**
- * Compare network addresses of two routes.
+ * Compare routes by the interface address.
+ * Several routes may share an interface so the network is used to make the
+ * key unique.
  */
-static int route_network_cmp(struct ip_route_entry * a,
-                             struct ip_route_entry * b)
-{
-    return a->route.r_network - b->route.r_network;
-}
-
 static int route_iface_cmp(struct ip_route_entry * a,
                            struct ip_route_entry * b)
 {
-    return a->route.r_iface - b->route.r_iface;
+    if (a->route.r_iface != b->route.r_iface) {
+        return (a->route.r_iface < b->route.r_iface) ? -1 : 1;
+    }
+    if (a->route.r_network != b->route.r_network) {
+        return (a->route.r_network < b->route.r_network) ? -1 : 1;
+    }
+    if (a->route.r_netmask != b->route.r_netmask) {
+        return (a->route.r_netmask < b->route.r_netmask) ? -1 : 1;
+    }
+    return 0;
 }
 
-RB_GENERATE_STATIC(rib_routetree, ip_route_entry, _rib_rtree_entry,
-                   route_network_cmp);
 RB_GENERATE_STATIC(rib_sourcetree, ip_route_entry, _rib_stree_entry,
                    route_iface_cmp);
 
+static inline in_addr_t rib_mask(unsigned len)
+{
+    return (len) ? ~(in_addr_t)0 << (RIB_PREFIX_MAX - len) : 0;
+}
+
 /**
- * Get a new route entry from the free list.
+ * Get the bit following a prefix of length len.
  */
-static struct ip_route_entry * ip_route_entry_alloc(void)
+static inline int rib_bit(in_addr_t addr, unsigned len)
 {
-    struct ip_route_entry * entry;
+    return (addr >> (RIB_PREFIX_MAX - 1 - len)) & 1;
+}
+
+/**
+ * Convert a network mask to a prefix length.
+ * @returns the prefix length or -1 if the mask is not contiguous.
+ */
+static int rib_mask2len(in_addr_t netmask)
+{
+    const unsigned len = __builtin_popcount(netmask);
+
+    return (rib_mask(len) == netmask) ? (int)len : -1;
+}
+
+static struct rib_node * rib_node_alloc(in_addr_t prefix, unsigned len,
+                                        struct ip_route_entry * entry)
+{
+    struct rib_node * node;
 
-    entry = SLIST_FIRST(&rib_freelist);
-    SLIST_REMOVE_HEAD(&rib_freelist, _rib_freelist_entry);
+    node = calloc(1, sizeof(struct rib_node));
+    if (!node) {
+        return NULL;
+    }
+    node->prefix = prefix & rib_mask(len);
+    node->len = len;
+    node->entry = entry;
 
-    return entry;
+    return node;
 }
 
 /**
- * Put a route entry back to the free list.
+ * Find the node of an exact prefix.
+ * @param[out] parent is set to the link pointing to the parent of the node.
+ * @returns a pointer to the link pointing to the node or NULL.
  */
-static void ip_route_entry_free(struct ip_route_entry * entry)
+static struct rib_node ** rib_find(in_addr_t prefix, unsigned len,
+                                   struct rib_node *** parent)
 {
-    SLIST_INSERT_HEAD(&rib_freelist, entry, _rib_freelist_entry);
+    struct rib_node ** link = &rib_root;
+    struct rib_node * node;
+
+    if (parent) {
+        *parent = NULL;
+    }
+
+    while ((node = *link)) {
+        if (node->len > len ||
+            ((prefix ^ node->prefix) & rib_mask(node->len))) {
+            break;
+        }
+        if (node->len == len) {
+            return (node->entry) ? link : NULL;
+        }
+        if (parent) {
+            *parent = link;
+        }
+        link = &node->child[rib_bit(prefix, node->len)];
+    }
+
+    return NULL;
 }
 
-static void ip_route_tree_insert(struct ip_route_entry * entry)
+static int rib_insert(in_addr_t prefix, unsigned len,
+                      struct ip_route_entry * entry)
 {
-    RB_INSERT(rib_routetree, &rib_routetree, entry);
-    RB_INSERT(rib_sourcetree, &rib_sourcetree, entry);
+    struct rib_node ** link = &rib_root;
+    struct rib_node * node;
+    struct rib_node * new;
+
+    prefix &= rib_mask(len);
+
+    while ((node = *link)) {
+        const in_addr_t diff = prefix ^ node->prefix;
+        unsigned common = (diff) ? (unsigned)__builtin_clz(diff) :
+                                   RIB_PREFIX_MAX;
+
+        common = min(common, min(len, node->len));
+        if (common == node->len) {
+            if (node->len == len) {
+                node->entry = entry;
+                return 0;
+            }
+            link = &node->child[rib_bit(prefix, node->len)];
+            continue;
+        }
+
+        new = rib_node_alloc(prefix, len, entry);
+        if (!new) {
+            return -1;
+        }
+
+        if (common == len) {
+            /* The new prefix covers the node. */
+            new->child[rib_bit(node->prefix, len)] = node;
+            *link = new;
+        } else {
+            struct rib_node * glue;
+
+            glue = rib_node_alloc(prefix, common, NULL);
+            if (!glue) {
+                free(new);
+                return -1;
+            }
+            glue->child[rib_bit(prefix, common)] = new;
+            glue->child[rib_bit(node->prefix, common)] = node;
+            *link = glue;
+        }
+        return 0;
+    }
+
+    new = rib_node_alloc(prefix, len, entry);
+    if (!new) {
+        return -1;
+    }
+    *link = new;
+
+    return 0;
 }
 
-static void ip_route_tree_remove(struct ip_route_entry * entry)
+/**
+ * Remove a node that no longer holds a route if it has less than two
+ * children.
+ */
+static void rib_prune(struct rib_node ** link)
 {
-    RB_REMOVE(rib_routetree, &rib_routetree, entry);
-    RB_REMOVE(rib_sourcetree, &rib_sourcetree, entry);
+    struct rib_node * node = *link;
+
+    if (node->entry || (node->child[0] && node->child[1])) {
+        return;
+    }
+
+    *link = (node->child[0]) ? node->child[0] : node->child[1];
+    free(node);
 }
 
-static int ip_route_add(struct ip_route * route)
+static struct ip_route_entry * rib_lookup(in_addr_t addr)
 {
-    struct ip_route_entry * entry;
+    struct rib_node * node = rib_root;
+    struct ip_route_entry * best = NULL;
 
-    entry = ip_route_entry_alloc();
-    if (!entry) {
-        errno = ENOMEM;
-        return -1;
+    while (node) {
+        if ((addr ^ node->prefix) & rib_mask(node->len)) {
+            break;
+        }
+        if (node->entry) {
+            best = node->entry;
+        }
+        if (node->len == RIB_PREFIX_MAX) {
+            break;
+        }
+        node = node->child[rib_bit(addr, node->len)];
     }
 
-    entry->route = *route;
-    ip_route_tree_insert(entry);
+    return best;
+}
 
-    return 0;
+static void rib_changed(void)
+{
+    if (__atomic_add_fetch(&rib_gen, 1, __ATOMIC_RELEASE) == 0) {
+        __atomic_store_n(&rib_gen, 1, __ATOMIC_RELEASE);
+    }
+}
+
+unsigned ip_route_generation(void)
+{
+    return __atomic_load_n(&rib_gen, __ATOMIC_ACQUIRE);
 }
 
 int ip_route_update(struct ip_route * route)
 {
     struct ip_route_entry * entry;
+    struct rib_node ** link;
+    int len;
+
+    len = rib_mask2len(route->r_netmask);
+    if (len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    entry = RB_FIND(rib_routetree, &rib_routetree,
-                    (struct ip_route_entry *)route);
-    if (entry) { /* Update an existing entry. */
-        ip_route_tree_remove(entry);
+    link = rib_find(route->r_network, len, NULL);
+    if (link) { /* Update an existing entry. */
+        entry = (*link)->entry;
+        RB_REMOVE(rib_sourcetree, &rib_sourcetree, entry);
         entry->route = *route;
-        ip_route_tree_insert(entry);
-    } else { /* Route not found so we insert it. */
-        if (ip_route_add(route)) {
-            return -1;
-        }
+        entry->route.r_network &= route->r_netmask;
+        RB_INSERT(rib_sourcetree, &rib_sourcetree, entry);
+        rib_changed();
+
+        return 0;
+    }
+
+    /* Route not found so we insert it. */
+    entry = calloc(1, sizeof(struct ip_route_entry));
+    if (!entry) {
+        errno = ENOMEM;
+        return -1;
     }
+    entry->route = *route;
+    entry->route.r_network &= route->r_netmask;
+
+    if (rib_insert(entry->route.r_network, len, entry)) {
+        free(entry);
+        errno = ENOMEM;
+        return -1;
+    }
+    RB_INSERT(rib_sourcetree, &rib_sourcetree, entry);
+    rib_changed();
 
     return 0;
 }
@@ -115,49 +282,36 @@ int ip_route_update(struct ip_route * route)
 int ip_route_remove(struct ip_route * route)
 {
     struct ip_route_entry * entry;
+    struct rib_node ** link;
+    struct rib_node ** parent;
+    int len;
 
-    entry = RB_FIND(rib_routetree, &rib_routetree,
-                    (struct ip_route_entry *)route);
-    if (!entry) {
+    len = rib_mask2len(route->r_netmask);
+    if (len < 0 || !(link = rib_find(route->r_network, len, &parent))) {
         errno = ENOENT;
         return -1;
     }
 
-    ip_route_tree_remove(entry);
-    memset(entry, 0, sizeof(struct ip_route_entry));
-    ip_route_entry_free(entry);
+    entry = (*link)->entry;
+    (*link)->entry = NULL;
+    RB_REMOVE(rib_sourcetree, &rib_sourcetree, entry);
+    free(entry);
+
+    /* Only the node itself and its parent may have become redundant. */
+    rib_prune(link);
+    if (parent) {
+        rib_prune(parent);
+    }
+    rib_changed();
 
     return 0;
 }
 
 int ip_route_find_by_network(in_addr_t addr, struct ip_route * route)
 {
-    struct ip_route find[] = {
-        { .r_network = addr },
-        { .r_network = 0 }
-    };
-    struct ip_route_entry * entry = NULL;
-
-    switch (0) {
-    case 0: /* First we try exact match */
-        entry = RB_FIND(rib_routetree, &rib_routetree,
-                        (struct ip_route_entry *)(&find));
-        if (entry)
-            goto match;
-    case 1: /* Then with network masks */
-        RB_FOREACH(entry, rib_routetree, &rib_routetree) {
-            if (entry->route.r_network == (addr & entry->route.r_netmask)) {
-                goto match;
-            }
-        }
-    default: /* And finally we check if there is a default gw */
-        entry = RB_FIND(rib_routetree, &rib_routetree,
-                        (struct ip_route_entry *)(find + 1));
-        if (entry)
-            goto match;
-    }
+    struct ip_route_entry * entry;
 
-match:
+    entry = rib_lookup(addr);
     if (!entry) {
         errno = ENOENT;
         return -1;
@@ -171,12 +325,12 @@ match:
 
 int ip_route_find_by_iface(in_addr_t addr, struct ip_route * route)
 {
-    struct ip_route find = { .r_iface = addr };
+    struct ip_route_entry find = { .route.r_iface = addr };
     struct ip_route_entry * entry;
 
-    entry = RB_FIND(rib_sourcetree, &rib_sourcetree,
-                    (struct ip_route_entry *)(&find));
-    if (!entry) {
+    /* The lowest key of the interface. */
+    entry = RB_NFIND(rib_sourcetree, &rib_sourcetree, &find);
+    if (!entry || entry->route.r_iface != addr) {
         errno = ENOENT;
         return -1;
     }
@@ -189,13 +343,6 @@ int ip_route_find_by_iface(in_addr_t addr, struct ip_route * route)
 
 __constructor void ip_route_init(void)
 {
-    size_t i;
-
-    RB_INIT(&rib_routetree);
+    rib_root = NULL;
     RB_INIT(&rib_sourcetree);
-    SLIST_INIT(&rib_freelist);
-
-    for (i = 0; i < num_elem(rib); i++) {
-        SLIST_INSERT_HEAD(&rib_freelist, &rib[i], _rib_freelist_entry);
-    }
 }
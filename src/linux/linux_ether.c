@@ -1,14 +1,19 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <linux/if_arp.h>
+#include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -19,11 +24,59 @@
 
 #define DEFAULT_IF      "eth0"
 #define ETHER_MAX_IF    1
+#define ETHER_FILTER_MAX_INET4  16
+
+/**
+ * TPACKET_V3 receive ring.
+ */
+struct ether_rx_ring {
+    uint8_t * map;                  /*!< Mapped ring or NULL if not in use. */
+    size_t block_size;              /*!< Size of a block in bytes. */
+    size_t block_nr;                /*!< Number of blocks in the ring. */
+    size_t block;                   /*!< Index of the current block. */
+    struct tpacket_block_desc * bd; /*!< Current block if owned by us. */
+    struct tpacket3_hdr * frame;    /*!< Next frame in the current block. */
+    unsigned frames_left;           /*!< Frames left in the current block. */
+};
+
+/**
+ * TPACKET_V2 transmit ring.
+ */
+struct ether_tx_ring {
+    uint8_t * map;                  /*!< Mapped ring or NULL if not in use. */
+    size_t frame_size;              /*!< Size of a frame slot in bytes. */
+    size_t frame_nr;                /*!< Number of frame slots in the ring. */
+    size_t head;                    /*!< Index of the next free slot. */
+    unsigned pending;               /*!< Frames queued since the last kick. */
+};
 
 struct ether_linux {
     int el_fd;
     mac_addr_t el_mac;
     struct ifreq el_if_idx;
+    int el_rx_ring_en;
+    int el_tx_ring_en;
+    int el_csum_trust;              /*!< Report kernel verified checksums. */
+    struct {
+        uint32_t addr;
+        uint32_t netmask;
+    } el_inet4[ETHER_FILTER_MAX_INET4]; /*!< Addresses accepted by the filter. */
+    size_t el_inet4_nr;             /*!< 0 = Accept any IPv4 address. */
+    int el_inet4_overflow;
+    struct ether_rx_ring el_rx_ring;
+    uint8_t el_rx_buf[XSTACK_ETHER_RX_BURST][ETHER_MAXLEN]
+        __attribute__ ((aligned));
+    int el_tx_fd;                   /*!< TX ring socket. */
+    struct ether_tx_ring el_tx_ring;
+    pthread_mutex_t el_tx_lock;     /*!< Held from tx alloc to commit. */
+    uint8_t * el_tx_frame;          /*!< The frame currently reserved. */
+    /* sendmmsg() queue used if the TX ring is not in use. */
+    unsigned el_tx_msg_nr;
+    struct mmsghdr el_tx_msg[XSTACK_ETHER_TX_BATCH];
+    struct iovec el_tx_iov[XSTACK_ETHER_TX_BATCH];
+    struct sockaddr_ll el_tx_addr[XSTACK_ETHER_TX_BATCH];
+    uint8_t el_tx_buf[XSTACK_ETHER_TX_BATCH][ETHER_MAXLEN + ETHER_TX_FCS_LEN]
+        __attribute__ ((aligned));
 };
 
 static struct ether_linux ether_if[ETHER_MAX_IF];
@@ -31,14 +84,14 @@ static int ether_next_handle;
 
 static struct ether_linux * ether_handle2eth(int handle)
 {
-    if (handle >= ETHER_MAX_IF) {
+    if (handle < 0 || handle >= ETHER_MAX_IF) {
         errno = ENODEV;
         return NULL;
     }
     return &ether_if[handle];
 }
 
-int ether_handle2addr(int handle, mac_addr_t addr)
+static int linux_ether_handle2addr(int handle, mac_addr_t addr)
 {
     struct ether_linux * eth;
 
@@ -51,9 +104,138 @@ int ether_handle2addr(int handle, mac_addr_t addr)
     return 0;
 }
 
-int ether_addr2handle(const mac_addr_t addr __unused)
+/**
+ * Socket filter program builder.
+ * Jumps refer to labels that are resolved once the program is complete.
+ */
+enum filter_label {
+    FL_NEXT = 0,
+    FL_DST,
+    FL_DST_BCAST,
+    FL_PROTO,
+    FL_ACCEPT,
+    FL_DROP,
+    FL_NR,
+};
+
+#define FILTER_MAX_LEN  (20 + 2 * ETHER_FILTER_MAX_INET4)
+
+struct filter_prog {
+    struct sock_filter insn[FILTER_MAX_LEN];
+    uint8_t jt[FILTER_MAX_LEN];
+    uint8_t jf[FILTER_MAX_LEN];
+    size_t label[FL_NR];
+    size_t len;
+};
+
+static void filter_stmt(struct filter_prog * prog, uint16_t code, uint32_t k)
+{
+    prog->insn[prog->len] = (struct sock_filter)BPF_STMT(code, k);
+    prog->jt[prog->len] = FL_NEXT;
+    prog->jf[prog->len] = FL_NEXT;
+    prog->len++;
+}
+
+static void filter_jeq(struct filter_prog * prog, uint32_t k,
+                       enum filter_label jt, enum filter_label jf)
+{
+    prog->insn[prog->len] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ |
+                                                         BPF_K, k, 0, 0);
+    prog->jt[prog->len] = jt;
+    prog->jf[prog->len] = jf;
+    prog->len++;
+}
+
+static void filter_label(struct filter_prog * prog, enum filter_label label)
 {
-    return 0; /* TODO Implementation of ether_get_handle() */
+    prog->label[label] = prog->len;
+}
+
+static void filter_resolve(struct filter_prog * prog)
+{
+    for (size_t i = 0; i < prog->len; i++) {
+        if (prog->jt[i] != FL_NEXT) {
+            prog->insn[i].jt = prog->label[prog->jt[i]] - (i + 1);
+        }
+        if (prog->jf[i] != FL_NEXT) {
+            prog->insn[i].jf = prog->label[prog->jf[i]] - (i + 1);
+        }
+    }
+}
+
+/**
+ * Generate and attach a socket filter.
+ * The filter only accepts ARP and IPv4 frames sent to our MAC address or
+ * broadcast and not sent by us. If any IPv4 addresses are configured the
+ * IPv4 frames must also be addressed to one of them or be a broadcast.
+ */
+static int linux_ether_attach_filter(struct ether_linux * eth)
+{
+    const uint8_t * mac = eth->el_mac;
+    const uint32_t mac_hi = (uint32_t)mac[0] << 24 | (uint32_t)mac[1] << 16 |
+                            (uint32_t)mac[2] << 8 | mac[3];
+    const uint32_t mac_lo = (uint32_t)mac[4] << 8 | mac[5];
+    struct filter_prog prog = { .len = 0 };
+    struct sock_fprog fprog;
+
+    /* Drop our own frames. */
+    filter_stmt(&prog, BPF_LD | BPF_W | BPF_ABS, offsetof(struct ether_hdr,
+                                                          h_src));
+    filter_jeq(&prog, mac_hi, FL_NEXT, FL_DST);
+    filter_stmt(&prog, BPF_LD | BPF_H | BPF_ABS, offsetof(struct ether_hdr,
+                                                          h_src) + 4);
+    filter_jeq(&prog, mac_lo, FL_DROP, FL_NEXT);
+
+    /* Accept frames sent to us or broadcast. */
+    filter_label(&prog, FL_DST);
+    filter_stmt(&prog, BPF_LD | BPF_W | BPF_ABS, offsetof(struct ether_hdr,
+                                                          h_dst));
+    filter_jeq(&prog, mac_hi, FL_NEXT, FL_DST_BCAST);
+    filter_stmt(&prog, BPF_LD | BPF_H | BPF_ABS, offsetof(struct ether_hdr,
+                                                          h_dst) + 4);
+    filter_jeq(&prog, mac_lo, FL_PROTO, FL_NEXT);
+    filter_label(&prog, FL_DST_BCAST);
+    filter_stmt(&prog, BPF_LD | BPF_W | BPF_ABS, offsetof(struct ether_hdr,
+                                                          h_dst));
+    filter_jeq(&prog, 0xffffffff, FL_NEXT, FL_DROP);
+    filter_stmt(&prog, BPF_LD | BPF_H | BPF_ABS, offsetof(struct ether_hdr,
+                                                          h_dst) + 4);
+    filter_jeq(&prog, 0xffff, FL_NEXT, FL_DROP);
+
+    /* Accept ARP and IPv4. */
+    filter_label(&prog, FL_PROTO);
+    filter_stmt(&prog, BPF_LD | BPF_H | BPF_ABS, offsetof(struct ether_hdr,
+                                                          h_proto));
+    filter_jeq(&prog, ETHER_PROTO_ARP, FL_ACCEPT, FL_NEXT);
+    filter_jeq(&prog, ETHER_PROTO_IPV4, FL_NEXT, FL_DROP);
+
+    /* Accept IPv4 sent to one of our addresses. */
+    if (eth->el_inet4_nr > 0) {
+        /* The destination address of the IP header. */
+        filter_stmt(&prog, BPF_LD | BPF_W | BPF_ABS, ETHER_HEADER_LEN + 16);
+        filter_jeq(&prog, 0xffffffff, FL_ACCEPT, FL_NEXT);
+        for (size_t i = 0; i < eth->el_inet4_nr; i++) {
+            const uint32_t addr = eth->el_inet4[i].addr;
+            const uint32_t netmask = eth->el_inet4[i].netmask;
+
+            filter_jeq(&prog, addr, FL_ACCEPT, FL_NEXT);
+            filter_jeq(&prog, addr | ~netmask, FL_ACCEPT, FL_NEXT);
+        }
+        prog.jf[prog.len - 1] = FL_DROP;
+    }
+
+    filter_label(&prog, FL_ACCEPT);
+    filter_stmt(&prog, BPF_RET | BPF_K, 0xffffffff);
+    filter_label(&prog, FL_DROP);
+    filter_stmt(&prog, BPF_RET | BPF_K, 0);
+    filter_resolve(&prog);
+
+    fprog = (struct sock_fprog){
+        .len = prog.len,
+        .filter = prog.insn,
+    };
+    return setsockopt(eth->el_fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                      sizeof(fprog));
 }
 
 static int linux_ether_bind(struct ether_linux * eth)
@@ -74,6 +256,11 @@ static int linux_ether_bind(struct ether_linux * eth)
         return -1;
     }
 
+    /* Filter out unrelated frames before any are queued to the socket. */
+    if (linux_ether_attach_filter(eth)) {
+        LOG(LOG_WARN, "Failed to attach a socket filter");
+    }
+
     socket_address.sll_family = AF_PACKET;
     socket_address.sll_protocol = htons(ETH_P_ALL);
     socket_address.sll_ifindex = eth->el_if_idx.ifr_ifindex;
@@ -103,7 +290,150 @@ static int linux_ether_set_rxtimeout(struct ether_linux * eth)
                       sizeof(struct timeval));
 }
 
-int ether_init(char * const args[])
+static int linux_ether_rx_ring_init(struct ether_linux * eth)
+{
+    struct ether_rx_ring * ring = &eth->el_rx_ring;
+    const int version = TPACKET_V3;
+    struct tpacket_req3 req = {
+        .tp_block_size = XSTACK_ETHER_RX_BLOCK_SIZE,
+        .tp_block_nr = XSTACK_ETHER_RX_BLOCK_NR,
+        .tp_frame_size = XSTACK_ETHER_RX_FRAME_SIZE,
+        .tp_frame_nr = (XSTACK_ETHER_RX_BLOCK_SIZE /
+                        XSTACK_ETHER_RX_FRAME_SIZE) *
+                       XSTACK_ETHER_RX_BLOCK_NR,
+        .tp_retire_blk_tov = XSTACK_ETHER_RX_BLOCK_TMO,
+    };
+    void * map;
+
+    if (setsockopt(eth->el_fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) ||
+        setsockopt(eth->el_fd, SOL_PACKET, PACKET_RX_RING, &req,
+                   sizeof(req))) {
+        return -1;
+    }
+
+    map = mmap(NULL, (size_t)req.tp_block_size * req.tp_block_nr,
+               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               eth->el_fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    *ring = (struct ether_rx_ring){
+        .map = map,
+        .block_size = req.tp_block_size,
+        .block_nr = req.tp_block_nr,
+    };
+
+    return 0;
+}
+
+static void linux_ether_rx_ring_deinit(struct ether_linux * eth)
+{
+    struct ether_rx_ring * ring = &eth->el_rx_ring;
+
+    if (ring->map) {
+        munmap(ring->map, ring->block_size * ring->block_nr);
+        ring->map = NULL;
+    }
+}
+
+/**
+ * Set up a TX ring on a separate socket.
+ * The socket is bound with protocol 0 so it never receives anything.
+ */
+static int linux_ether_tx_ring_init(struct ether_linux * eth)
+{
+    struct ether_tx_ring * ring = &eth->el_tx_ring;
+    const int version = TPACKET_V2;
+    const int loss = 1;
+    struct tpacket_req req = {
+        .tp_block_size = XSTACK_ETHER_TX_FRAME_SIZE * XSTACK_ETHER_TX_FRAME_NR,
+        .tp_block_nr = 1,
+        .tp_frame_size = XSTACK_ETHER_TX_FRAME_SIZE,
+        .tp_frame_nr = XSTACK_ETHER_TX_FRAME_NR,
+    };
+    struct sockaddr_ll socket_address = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = 0,
+        .sll_ifindex = eth->el_if_idx.ifr_ifindex,
+    };
+    void * map;
+
+    eth->el_tx_fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (eth->el_tx_fd == -1) {
+        return -1;
+    }
+
+    /* Skip malformed frames instead of stalling the ring on them. */
+    if (setsockopt(eth->el_tx_fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) ||
+        setsockopt(eth->el_tx_fd, SOL_PACKET, PACKET_LOSS, &loss,
+                   sizeof(loss)) ||
+        setsockopt(eth->el_tx_fd, SOL_PACKET, PACKET_TX_RING, &req,
+                   sizeof(req)) ||
+        bind(eth->el_tx_fd, (struct sockaddr *)&socket_address,
+             sizeof(socket_address))) {
+        goto fail;
+    }
+
+    map = mmap(NULL, (size_t)req.tp_block_size * req.tp_block_nr,
+               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               eth->el_tx_fd, 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+
+    *ring = (struct ether_tx_ring){
+        .map = map,
+        .frame_size = req.tp_frame_size,
+        .frame_nr = req.tp_frame_nr,
+    };
+
+    return 0;
+fail:
+    close(eth->el_tx_fd);
+    eth->el_tx_fd = -1;
+    return -1;
+}
+
+static void linux_ether_tx_ring_deinit(struct ether_linux * eth)
+{
+    struct ether_tx_ring * ring = &eth->el_tx_ring;
+
+    if (ring->map) {
+        munmap(ring->map, ring->frame_size * ring->frame_nr);
+        ring->map = NULL;
+        close(eth->el_tx_fd);
+        eth->el_tx_fd = -1;
+    }
+}
+
+static int linux_ether_parse_opt(struct ether_linux * eth, const char * opt)
+{
+    const char * value;
+
+    if ((value = ether_opt_value(opt, "rx_ring"))) {
+        eth->el_rx_ring_en = !!atoi(value);
+    } else if ((value = ether_opt_value(opt, "tx_ring"))) {
+        eth->el_tx_ring_en = !!atoi(value);
+    } else if ((value = ether_opt_value(opt, "csum_trust"))) {
+        eth->el_csum_trust = !!atoi(value);
+    } else if ((value = ether_opt_value(opt, "hwaddr"))) {
+        /* TODO Parse MAC addr */
+        errno = ENOTSUP;
+        return -1;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int linux_ether_tx_flush(int handle);
+
+static int linux_ether_init(char * const args[])
 {
     const int handle = ether_next_handle;
     struct ether_linux * eth;
@@ -116,10 +446,20 @@ int ether_init(char * const args[])
     }
     eth = &ether_if[handle];
     ether_next_handle++;
+    eth->el_rx_ring_en = XSTACK_ETHER_RX_RING;
+    eth->el_tx_ring_en = XSTACK_ETHER_TX_RING;
+    eth->el_csum_trust = XSTACK_ETHER_CSUM_TRUST;
+    eth->el_tx_fd = -1;
 
-    /* TODO Parse args */
     if (args[0]) { /* Non-default IF */
-        strcpy(if_name, args[0]);
+        strncpy(if_name, args[0], IFNAMSIZ - 1);
+        if_name[IFNAMSIZ - 1] = '\0';
+
+        for (size_t i = 1; args[i]; i++) {
+            if (linux_ether_parse_opt(eth, args[i])) {
+                return -1;
+            }
+        }
     } else { /* Default IF */
         strcpy(if_name, DEFAULT_IF);
     }
@@ -136,39 +476,58 @@ int ether_init(char * const args[])
     }
 
     /* Get the MAC address of the interface */
-    if (args[0] && args[1]) { /* MAC addr given by the user */
-        /* TODO Parse MAC addr */
-        errno = ENOTSUP;
-        return -1;
-    } else { /* Use the default MAC addr */
-        memset(&if_mac, 0, sizeof(struct ifreq));
-        strncpy(if_mac.ifr_name, if_name, IFNAMSIZ - 1);
-        if (ioctl(eth->el_fd, SIOCGIFHWADDR, &if_mac) < 0) {
-            goto fail;
-        }
-        eth->el_mac[0] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[0];
-        eth->el_mac[1] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[1];
-        eth->el_mac[2] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[2];
-        eth->el_mac[3] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[3];
-        eth->el_mac[4] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[4];
-        eth->el_mac[5] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[5];
+    memset(&if_mac, 0, sizeof(struct ifreq));
+    strncpy(if_mac.ifr_name, if_name, IFNAMSIZ - 1);
+    if (ioctl(eth->el_fd, SIOCGIFHWADDR, &if_mac) < 0) {
+        goto fail;
+    }
+    eth->el_mac[0] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[0];
+    eth->el_mac[1] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[1];
+    eth->el_mac[2] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[2];
+    eth->el_mac[3] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[3];
+    eth->el_mac[4] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[4];
+    eth->el_mac[5] = ((uint8_t *)&if_mac.ifr_hwaddr.sa_data)[5];
+
+    if (eth->el_rx_ring_en && linux_ether_rx_ring_init(eth)) {
+        LOG(LOG_WARN, "Failed to set up an RX ring, using recvfrom()");
     }
 
     if (linux_ether_bind(eth)) {
         goto fail;
     }
 
+    /* The ring carries the status in the frame header. */
+    if (eth->el_csum_trust && !eth->el_rx_ring.map) {
+        const int one = 1;
+
+        if (setsockopt(eth->el_fd, SOL_PACKET, PACKET_AUXDATA, &one,
+                       sizeof(one))) {
+            LOG(LOG_WARN, "Failed to enable PACKET_AUXDATA");
+            eth->el_csum_trust = 0;
+        }
+    }
+
     if (linux_ether_set_rxtimeout(eth)) {
         goto fail;
     }
 
+    if (eth->el_tx_ring_en && linux_ether_tx_ring_init(eth)) {
+        LOG(LOG_WARN, "Failed to set up a TX ring, using sendto()");
+    }
+
+    if (pthread_mutex_init(&eth->el_tx_lock, NULL)) {
+        goto fail;
+    }
+
     return handle;
 fail:
+    linux_ether_tx_ring_deinit(eth);
+    linux_ether_rx_ring_deinit(eth);
     close(eth->el_fd);
     return -1;
 }
 
-void ether_deinit(int handle)
+static void linux_ether_deinit(int handle)
 {
     struct ether_linux * eth;
 
@@ -176,97 +535,469 @@ void ether_deinit(int handle)
         return;
     }
 
+    linux_ether_tx_flush(handle);
+    linux_ether_tx_ring_deinit(eth);
+    linux_ether_rx_ring_deinit(eth);
+    pthread_mutex_destroy(&eth->el_tx_lock);
     close(eth->el_fd);
 }
 
-int ether_receive(int handle, struct ether_hdr * hdr, uint8_t * buf,
-                  size_t bsize)
+/**
+ * Get the next frames from the RX ring.
+ * Blocks are handed back to the kernel once all of their frames have been
+ * consumed, so the returned frames stay valid until the next call.
+ * A burst never spans more than one block.
+ */
+static int rx_ring_receive(struct ether_linux * eth, uint8_t ** frames,
+                           int * lens, unsigned * status, size_t nr)
 {
-    struct ether_linux * eth;
-    uint8_t frame[ETHER_MAXLEN] __attribute__ ((aligned));
-    struct ether_hdr * frame_hdr = (struct ether_hdr *)frame;
+    struct ether_rx_ring * ring = &eth->el_rx_ring;
+    size_t n = 0;
+
+    while (ring->frames_left == 0) {
+        struct tpacket_block_desc * bd;
+        struct pollfd pfd = {
+            .fd = eth->el_fd,
+            .events = POLLIN | POLLERR,
+        };
+        int retval;
+
+        if (ring->bd) {
+            __atomic_store_n(&ring->bd->hdr.bh1.block_status,
+                             TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+            ring->bd = NULL;
+            ring->block = (ring->block + 1) % ring->block_nr;
+        }
+
+        bd = (struct tpacket_block_desc *)(ring->map +
+                                           ring->block * ring->block_size);
+        if (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+            TP_STATUS_USER) {
+            ring->bd = bd;
+            ring->frame = (struct tpacket3_hdr *)((uint8_t *)bd +
+                          bd->hdr.bh1.offset_to_first_pkt);
+            ring->frames_left = bd->hdr.bh1.num_pkts;
+            continue;
+        }
+
+        retval = poll(&pfd, 1, XSTACK_PERIODIC_EVENT_SEC * 1000);
+        if (retval == 0 || (retval == -1 && errno == EINTR)) {
+            return 0;
+        } else if (retval == -1) {
+            return -1;
+        }
+    }
+
+    while (n < nr && ring->frames_left > 0) {
+        struct tpacket3_hdr * hdr = ring->frame;
+
+        ring->frame = (struct tpacket3_hdr *)((uint8_t *)hdr +
+                                              hdr->tp_next_offset);
+        ring->frames_left--;
+
+        frames[n] = (uint8_t *)hdr + hdr->tp_mac;
+        lens[n] = (int)hdr->tp_snaplen;
+        status[n] = hdr->tp_status;
+        n++;
+    }
+
+    return (int)n;
+}
+
+static int rx_sock_receive(struct ether_linux * eth, uint8_t ** frames,
+                           int * lens, unsigned * status, size_t nr)
+{
+    struct mmsghdr msg[XSTACK_ETHER_RX_BURST];
+    struct iovec iov[XSTACK_ETHER_RX_BURST];
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+    } cmsg[XSTACK_ETHER_RX_BURST];
     int retval;
 
-    assert(hdr != NULL);
-    assert(buf != NULL);
+    for (size_t i = 0; i < nr; i++) {
+        iov[i].iov_base = eth->el_rx_buf[i];
+        iov[i].iov_len = sizeof(eth->el_rx_buf[i]);
+        msg[i].msg_hdr = (struct msghdr){
+            .msg_iov = &iov[i],
+            .msg_iovlen = 1,
+        };
+        if (eth->el_csum_trust) {
+            msg[i].msg_hdr.msg_control = cmsg[i].buf;
+            msg[i].msg_hdr.msg_controllen = sizeof(cmsg[i].buf);
+        }
+    }
+
+    /* Blocks until the first frame or the timeout. */
+    retval = recvmmsg(eth->el_fd, msg, nr, MSG_WAITFORONE, NULL);
+    if (retval == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                         errno == EINPROGRESS || errno == EINTR)) {
+        return 0;
+    }
+
+    for (int i = 0; i < retval; i++) {
+        struct cmsghdr * cm;
+
+        frames[i] = eth->el_rx_buf[i];
+        lens[i] = (int)msg[i].msg_len;
+        status[i] = 0;
+
+        for (cm = CMSG_FIRSTHDR(&msg[i].msg_hdr); cm;
+             cm = CMSG_NXTHDR(&msg[i].msg_hdr, cm)) {
+            if (cm->cmsg_level == SOL_PACKET &&
+                cm->cmsg_type == PACKET_AUXDATA) {
+                struct tpacket_auxdata aux;
+
+                memcpy(&aux, CMSG_DATA(cm), sizeof(aux));
+                status[i] = aux.tp_status;
+            }
+        }
+    }
+
+    return retval;
+}
+
+static int linux_ether_receive_burst(int handle, struct ether_frame * frames,
+                                     size_t nr)
+{
+    struct ether_linux * eth;
+    uint8_t * frame[XSTACK_ETHER_RX_BURST];
+    int len[XSTACK_ETHER_RX_BURST];
+    unsigned status[XSTACK_ETHER_RX_BURST];
+    size_t out = 0;
+
+    assert(frames != NULL);
 
     if (!(eth = ether_handle2eth(handle))) {
         return -1;
     }
+    nr = ulmin(nr, XSTACK_ETHER_RX_BURST);
 
     do {
-        retval = (int)recvfrom(eth->el_fd, frame, sizeof(frame), 0, NULL, NULL);
-        if (retval == -1 &&  (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) {
-            return 0;
-        } else if (retval == -1) {
-            return -1;
+        int n;
+
+        n = (eth->el_rx_ring.map) ?
+            rx_ring_receive(eth, frame, len, status, nr) :
+            rx_sock_receive(eth, frame, len, status, nr);
+        if (n <= 0) {
+            return n;
         }
-    } while (!memcmp(frame_hdr->h_src, eth->el_mac, sizeof(mac_addr_t)));
 
-    memcpy(hdr->h_dst, frame_hdr->h_dst, sizeof(mac_addr_t));
-    memcpy(hdr->h_src, frame_hdr->h_src, sizeof(mac_addr_t));
-    hdr->h_proto = ntohs(frame_hdr->h_proto);
+        for (int i = 0; i < n; i++) {
+            struct ether_hdr * frame_hdr = (struct ether_hdr *)frame[i];
+            struct ether_frame * f = &frames[out];
+
+            /* Our own frames are also dropped by the socket filter. */
+            if (len[i] < ETHER_HEADER_LEN ||
+                !memcmp(frame_hdr->h_src, eth->el_mac, sizeof(mac_addr_t))) {
+                continue;
+            }
+
+            memcpy(f->hdr.h_dst, frame_hdr->h_dst, sizeof(mac_addr_t));
+            memcpy(f->hdr.h_src, frame_hdr->h_src, sizeof(mac_addr_t));
+            f->hdr.h_proto = ntohs(frame_hdr->h_proto);
+            f->payload = frame[i] + ETHER_HEADER_LEN;
+            f->bsize = len[i] - ETHER_HEADER_LEN;
+            f->flags = 0;
+            /*
+             * TP_STATUS_CSUMNOTREADY means that the checksum was never
+             * computed, so it must still be verified.
+             */
+            if (eth->el_csum_trust && (status[i] & TP_STATUS_CSUM_VALID)) {
+                f->flags |= ETHER_FRAME_CSUM_VALID;
+            }
+
+            /*
+             * Ring frames are packed back to back so there is no room for a
+             * reply that is longer than the frame. Short frames are cheap
+             * to bounce.
+             */
+            if (eth->el_rx_ring.map && f->bsize < ETHER_RX_BUF_MIN) {
+                memcpy(eth->el_rx_buf[out], f->payload, f->bsize);
+                f->payload = eth->el_rx_buf[out];
+            }
+            out++;
+        }
+    } while (out == 0);
 
-    retval -= ETHER_HEADER_LEN;
-    memcpy(buf, frame + ETHER_HEADER_LEN, min(retval, bsize));
+    return (int)out;
+}
 
-    return retval;
+static struct tpacket2_hdr * tx_ring_slot(struct ether_tx_ring * ring,
+                                          size_t i)
+{
+    return (struct tpacket2_hdr *)(ring->map + i * ring->frame_size);
 }
 
-int ether_send(int handle, const mac_addr_t dst, uint16_t proto,
-               uint8_t * buf, size_t bsize)
+/**
+ * Kick the kernel to transmit all frames queued in the TX ring.
+ */
+static int tx_ring_kick(struct ether_linux * eth, int flags)
 {
-    struct ether_linux * eth;
-    struct sockaddr_ll socket_address;
-    const size_t frame_size = ETHER_HEADER_LEN +
-                              max(bsize, ETHER_MINLEN - ETHER_FCS_LEN) +
-                              ETHER_FCS_LEN;
-    uint8_t frame[frame_size] __attribute__ ((aligned));
-    uint32_t fcs;
-    uint8_t * data = frame + ETHER_HEADER_LEN;
-    struct ether_hdr * frame_hdr = (struct ether_hdr *)frame;
-    uint32_t * fcs_p = (uint32_t *)&frame[frame_size - ETHER_FCS_LEN];
-    int retval;
+    eth->el_tx_ring.pending = 0;
+    if (send(eth->el_tx_fd, NULL, 0, flags) == -1 && errno != EAGAIN) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Get the frame buffer of the next free TX ring slot.
+ */
+static uint8_t * tx_ring_frame(struct ether_linux * eth)
+{
+    struct ether_tx_ring * ring = &eth->el_tx_ring;
+    struct tpacket2_hdr * hdr = tx_ring_slot(ring, ring->head);
+
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) !=
+        TP_STATUS_AVAILABLE) {
+        /* The ring is full, wait until the kernel has drained it. */
+        if (tx_ring_kick(eth, 0)) {
+            return NULL;
+        }
+        if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) !=
+            TP_STATUS_AVAILABLE) {
+            errno = ENOBUFS;
+            return NULL;
+        }
+    }
+
+    return (uint8_t *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+}
 
-    assert(buf != NULL);
+/**
+ * Test whether a send error affects the socket rather than a single frame.
+ */
+static int tx_sock_fatal(int err)
+{
+    switch (err) {
+    case EBADF:
+    case ENOTSOCK:
+    case ENODEV:
+    case ENXIO:
+    case ENETDOWN:
+        return 1;
+    default:
+        return 0;
+    }
+}
 
-    if (frame_size > ETHER_MAXLEN + ETHER_FCS_LEN) {
-        retval = -EMSGSIZE;
-        goto out;
+/**
+ * Send all frames queued for sendmmsg().
+ * Frames that couldn't be sent are dropped.
+ */
+static int tx_sock_flush(struct ether_linux * eth)
+{
+    const unsigned nr = eth->el_tx_msg_nr;
+    unsigned sent = 0;
+
+    eth->el_tx_msg_nr = 0;
+    while (sent < nr) {
+        int retval;
+
+        retval = sendmmsg(eth->el_fd, eth->el_tx_msg + sent, nr - sent, 0);
+        if (retval == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (tx_sock_fatal(errno)) {
+                return -1;
+            }
+            /*
+             * sendmmsg() only fails if the first message fails, skip it
+             * and send the rest.
+             */
+            retval = 1;
+        }
+        sent += retval;
     }
 
+    return 0;
+}
+
+/**
+ * Get the next free sendmmsg() buffer.
+ */
+static uint8_t * tx_sock_frame(struct ether_linux * eth)
+{
+    if (eth->el_tx_msg_nr == XSTACK_ETHER_TX_BATCH && tx_sock_flush(eth)) {
+        return NULL;
+    }
+
+    return eth->el_tx_buf[eth->el_tx_msg_nr];
+}
+
+static uint8_t * linux_ether_tx_alloc(int handle)
+{
+    struct ether_linux * eth;
+    uint8_t * frame;
+
     if (!(eth = ether_handle2eth(handle))) {
-        retval = -errno;
-        goto out;
+        return NULL;
     }
 
-    socket_address = (struct sockaddr_ll){
-        .sll_family = AF_PACKET,
-        .sll_protocol = htons(proto),
-        .sll_ifindex = eth->el_if_idx.ifr_ifindex,
-        .sll_halen = ETHER_ALEN,
-        .sll_addr[0] = dst[0],
-        .sll_addr[1] = dst[1],
-        .sll_addr[2] = dst[2],
-        .sll_addr[3] = dst[3],
-        .sll_addr[4] = dst[4],
-        .sll_addr[5] = dst[5],
-    };
+    pthread_mutex_lock(&eth->el_tx_lock);
+    frame = (eth->el_tx_ring.map) ? tx_ring_frame(eth) : tx_sock_frame(eth);
+    if (!frame) {
+        pthread_mutex_unlock(&eth->el_tx_lock);
+        return NULL;
+    }
+    eth->el_tx_frame = frame;
+
+    return frame + ETHER_HEADER_LEN;
+}
+
+static void tx_release(struct ether_linux * eth)
+{
+    eth->el_tx_frame = NULL;
+    pthread_mutex_unlock(&eth->el_tx_lock);
+}
+
+static void linux_ether_tx_abort(int handle)
+{
+    tx_release(ether_handle2eth(handle));
+}
+
+static int linux_ether_tx_commit(int handle, const mac_addr_t dst,
+                                 uint16_t proto, size_t bsize)
+{
+    struct ether_linux * eth = ether_handle2eth(handle);
+    struct ether_tx_ring * ring = &eth->el_tx_ring;
+    const size_t frame_size = ETHER_HEADER_LEN +
+                              max(bsize, ETHER_MINLEN - ETHER_HEADER_LEN) +
+                              ETHER_TX_FCS_LEN;
+    uint8_t * frame = eth->el_tx_frame;
+    uint8_t * data = frame + ETHER_HEADER_LEN;
+    struct ether_hdr * frame_hdr = (struct ether_hdr *)frame;
+#if XSTACK_ETHER_SW_FCS
+    uint32_t fcs;
+#endif
+    int retval = (int)frame_size;
+
+    if (frame_size > ETHER_MAXLEN + ETHER_TX_FCS_LEN) {
+        tx_release(eth);
+        return -EMSGSIZE;
+    }
 
     memcpy(frame_hdr->h_dst, dst, ETHER_ALEN);
     memcpy(frame_hdr->h_src, eth->el_mac, ETHER_ALEN);
     frame_hdr->h_proto = htons(proto);
-    memcpy(data, buf, bsize);
     memset(data + bsize, 0, frame_size - ETHER_HEADER_LEN - bsize);
+#if XSTACK_ETHER_SW_FCS
     fcs = ether_fcs(frame, frame_size - ETHER_FCS_LEN);
-    memcpy(fcs_p, &fcs, sizeof(uint32_t));
+    memcpy(frame + frame_size - ETHER_FCS_LEN, &fcs, sizeof(uint32_t));
+#endif
+
+    if (ring->map) {
+        struct tpacket2_hdr * hdr = tx_ring_slot(ring, ring->head);
+
+        hdr->tp_len = frame_size;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+                         __ATOMIC_RELEASE);
+        ring->head = (ring->head + 1) % ring->frame_nr;
+
+        if (++ring->pending >= XSTACK_ETHER_TX_BATCH &&
+            tx_ring_kick(eth, MSG_DONTWAIT)) {
+            retval = -errno;
+        }
+    } else {
+        const unsigned i = eth->el_tx_msg_nr++;
+
+        eth->el_tx_addr[i] = (struct sockaddr_ll){
+            .sll_family = AF_PACKET,
+            .sll_protocol = htons(proto),
+            .sll_ifindex = eth->el_if_idx.ifr_ifindex,
+            .sll_halen = ETHER_ALEN,
+            .sll_addr[0] = dst[0],
+            .sll_addr[1] = dst[1],
+            .sll_addr[2] = dst[2],
+            .sll_addr[3] = dst[3],
+            .sll_addr[4] = dst[4],
+            .sll_addr[5] = dst[5],
+        };
+        eth->el_tx_iov[i] = (struct iovec){
+            .iov_base = frame,
+            .iov_len = frame_size,
+        };
+        eth->el_tx_msg[i].msg_hdr = (struct msghdr){
+            .msg_name = &eth->el_tx_addr[i],
+            .msg_namelen = sizeof(struct sockaddr_ll),
+            .msg_iov = &eth->el_tx_iov[i],
+            .msg_iovlen = 1,
+        };
+
+        if (eth->el_tx_msg_nr >= XSTACK_ETHER_TX_BATCH && tx_sock_flush(eth)) {
+            retval = -errno;
+        }
+    }
+
+    tx_release(eth);
+    return retval;
+}
+
+static int linux_ether_tx_flush(int handle)
+{
+    struct ether_linux * eth;
+    int retval = 0;
 
-    retval = (int)sendto(eth->el_fd, frame, frame_size, 0,
-                         (struct sockaddr *)(&socket_address),
-                         sizeof(socket_address));
-    if (retval < 0) {
+    if (!(eth = ether_handle2eth(handle))) {
+        return -errno;
+    }
+
+    pthread_mutex_lock(&eth->el_tx_lock);
+    if (eth->el_tx_ring.pending > 0 && tx_ring_kick(eth, MSG_DONTWAIT)) {
+        retval = -errno;
+    } else if (eth->el_tx_msg_nr > 0 && tx_sock_flush(eth)) {
         retval = -errno;
     }
-out:
+    pthread_mutex_unlock(&eth->el_tx_lock);
+
     return retval;
 }
+
+static int linux_ether_add_inet4_addr(int handle, uint32_t addr,
+                                      uint32_t netmask)
+{
+    struct ether_linux * eth;
+
+    if (!(eth = ether_handle2eth(handle))) {
+        return -errno;
+    }
+
+    for (size_t i = 0; i < eth->el_inet4_nr; i++) {
+        if (eth->el_inet4[i].addr == addr &&
+            eth->el_inet4[i].netmask == netmask) {
+            return 0;
+        }
+    }
+    if (eth->el_inet4_overflow) {
+        return 0;
+    } else if (eth->el_inet4_nr == ETHER_FILTER_MAX_INET4) {
+        /* Too many addresses to filter, accept all IPv4 frames. */
+        eth->el_inet4_overflow = 1;
+        eth->el_inet4_nr = 0;
+    } else {
+        eth->el_inet4[eth->el_inet4_nr].addr = addr;
+        eth->el_inet4[eth->el_inet4_nr].netmask = netmask;
+        eth->el_inet4_nr++;
+    }
+
+    if (linux_ether_attach_filter(eth)) {
+        return -errno;
+    }
+    return 0;
+}
+
+static struct ether_driver linux_ether_driver = {
+    .name = "packet",
+    .init = linux_ether_init,
+    .deinit = linux_ether_deinit,
+    .handle2addr = linux_ether_handle2addr,
+    .receive_burst = linux_ether_receive_burst,
+    .tx_alloc = linux_ether_tx_alloc,
+    .tx_commit = linux_ether_tx_commit,
+    .tx_abort = linux_ether_tx_abort,
+    .tx_flush = linux_ether_tx_flush,
+    .add_inet4_addr = linux_ether_add_inet4_addr,
+};
+ETHER_DRIVER(linux_ether_driver);
@@ -0,0 +1,855 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "xstack_util.h"
+
+#include "../logger.h"
+#include "../xstack_ether.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP         283
+#endif
+#ifndef AF_XDP
+#define AF_XDP          44
+#endif
+
+#define DEFAULT_IF      "eth0"
+#define ETHER_MAX_IF    1
+#define XDP_MAX_QUEUES  64
+
+/**
+ * A mapped AF_XDP ring.
+ * Each ring has a single producer and a single consumer, the cached indices
+ * are our own copies of the index we own.
+ */
+struct xdp_ring {
+    void * map;
+    size_t map_len;
+    uint32_t * producer;
+    uint32_t * consumer;
+    void * desc;
+    uint32_t mask;
+    uint32_t cached_prod;
+    uint32_t cached_cons;
+};
+
+struct ether_xdp {
+    int ex_fd;
+    mac_addr_t ex_mac;
+    int ex_ifindex;
+    int ex_queue;
+    int ex_drv_mode;                /*!< Native XDP instead of SKB mode. */
+    int ex_map_fd;                  /*!< XSKMAP */
+    int ex_prog_fd;
+    int ex_link_fd;
+    uint8_t * ex_umem;
+    size_t ex_umem_len;
+    struct xdp_ring ex_fill;
+    struct xdp_ring ex_comp;
+    struct xdp_ring ex_rx;
+    struct xdp_ring ex_tx;
+    uint64_t ex_rx_lent[XSTACK_ETHER_RX_BURST]; /*!< Frames lent out. */
+    size_t ex_rx_lent_nr;
+    pthread_mutex_t ex_tx_lock;     /*!< Held from tx alloc to commit. */
+    uint64_t * ex_tx_free;          /*!< Stack of free TX frame addresses. */
+    size_t ex_tx_free_nr;
+    uint64_t ex_tx_frame;           /*!< The frame currently reserved. */
+    unsigned ex_tx_pending;         /*!< Frames queued since the last kick. */
+};
+
+static struct ether_xdp ether_if[ETHER_MAX_IF];
+static int ether_next_handle;
+
+static struct ether_xdp * ether_handle2eth(int handle)
+{
+    if (handle < 0 || handle >= ETHER_MAX_IF) {
+        errno = ENODEV;
+        return NULL;
+    }
+    return &ether_if[handle];
+}
+
+static int sys_bpf(int cmd, union bpf_attr * attr)
+{
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int xdp_ether_handle2addr(int handle, mac_addr_t addr)
+{
+    struct ether_xdp * eth;
+
+    if (!(eth = ether_handle2eth(handle))) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    memcpy(addr, eth->ex_mac, sizeof(mac_addr_t));
+    return 0;
+}
+
+static int xdp_ether_get_hwaddr(struct ether_xdp * eth, const char * if_name)
+{
+    struct ifreq if_mac = { 0 };
+    int fd, retval;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+        return -1;
+    }
+
+    strncpy(if_mac.ifr_name, if_name, IFNAMSIZ - 1);
+    retval = ioctl(fd, SIOCGIFHWADDR, &if_mac);
+    close(fd);
+    if (retval < 0) {
+        return -1;
+    }
+
+    memcpy(eth->ex_mac, if_mac.ifr_hwaddr.sa_data, sizeof(mac_addr_t));
+    return 0;
+}
+
+/**
+ * Map an AF_XDP ring.
+ * @param off are the ring offsets returned by XDP_MMAP_OFFSETS.
+ * @param desc_size is the size of a single ring entry.
+ */
+static int xdp_ring_map(struct xdp_ring * ring, int fd,
+                        const struct xdp_ring_offset * off, size_t desc_size,
+                        off_t pgoff)
+{
+    const uint32_t nr = XSTACK_ETHER_XDP_RING_SIZE;
+    uint8_t * map;
+
+    ring->map_len = off->desc + nr * desc_size;
+    map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (map == MAP_FAILED) {
+        ring->map = NULL;
+        return -1;
+    }
+
+    ring->map = map;
+    ring->producer = (uint32_t *)(map + off->producer);
+    ring->consumer = (uint32_t *)(map + off->consumer);
+    ring->desc = map + off->desc;
+    ring->mask = nr - 1;
+    ring->cached_prod = *ring->producer;
+    ring->cached_cons = *ring->consumer;
+
+    return 0;
+}
+
+static void xdp_ring_unmap(struct xdp_ring * ring)
+{
+    if (ring->map) {
+        munmap(ring->map, ring->map_len);
+        ring->map = NULL;
+    }
+}
+
+/**
+ * Get the number of free entries in a ring we produce to.
+ */
+static uint32_t xdp_ring_prod_free(struct xdp_ring * ring)
+{
+    ring->cached_cons = __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE);
+    return (ring->mask + 1) - (ring->cached_prod - ring->cached_cons);
+}
+
+static void xdp_ring_prod_submit(struct xdp_ring * ring)
+{
+    __atomic_store_n(ring->producer, ring->cached_prod, __ATOMIC_RELEASE);
+}
+
+/**
+ * Get the number of entries available in a ring we consume from.
+ */
+static uint32_t xdp_ring_cons_avail(struct xdp_ring * ring)
+{
+    ring->cached_prod = __atomic_load_n(ring->producer, __ATOMIC_ACQUIRE);
+    return ring->cached_prod - ring->cached_cons;
+}
+
+static void xdp_ring_cons_release(struct xdp_ring * ring)
+{
+    __atomic_store_n(ring->consumer, ring->cached_cons, __ATOMIC_RELEASE);
+}
+
+static int xdp_ether_umem_init(struct ether_xdp * eth)
+{
+    const size_t frame_nr = XSTACK_ETHER_XDP_FRAME_NR;
+    const size_t frame_size = XSTACK_ETHER_XDP_FRAME_SIZE;
+    const int ring_size = XSTACK_ETHER_XDP_RING_SIZE;
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    struct xdp_umem_reg mr;
+    size_t rx_frame_nr;
+    uint64_t * fill;
+
+    eth->ex_umem_len = frame_nr * frame_size;
+    eth->ex_umem = mmap(NULL, eth->ex_umem_len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (eth->ex_umem == MAP_FAILED) {
+        eth->ex_umem = NULL;
+        return -1;
+    }
+
+    mr = (struct xdp_umem_reg){
+        .addr = (uintptr_t)eth->ex_umem,
+        .len = eth->ex_umem_len,
+        .chunk_size = frame_size,
+        .headroom = 0,
+    };
+    if (setsockopt(eth->ex_fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) ||
+        setsockopt(eth->ex_fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size,
+                   sizeof(ring_size)) ||
+        setsockopt(eth->ex_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size,
+                   sizeof(ring_size)) ||
+        setsockopt(eth->ex_fd, SOL_XDP, XDP_RX_RING, &ring_size,
+                   sizeof(ring_size)) ||
+        setsockopt(eth->ex_fd, SOL_XDP, XDP_TX_RING, &ring_size,
+                   sizeof(ring_size))) {
+        return -1;
+    }
+
+    if (getsockopt(eth->ex_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)) {
+        return -1;
+    }
+
+    if (xdp_ring_map(&eth->ex_fill, eth->ex_fd, &off.fr, sizeof(uint64_t),
+                     XDP_UMEM_PGOFF_FILL_RING) ||
+        xdp_ring_map(&eth->ex_comp, eth->ex_fd, &off.cr, sizeof(uint64_t),
+                     XDP_UMEM_PGOFF_COMPLETION_RING) ||
+        xdp_ring_map(&eth->ex_rx, eth->ex_fd, &off.rx,
+                     sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) ||
+        xdp_ring_map(&eth->ex_tx, eth->ex_fd, &off.tx,
+                     sizeof(struct xdp_desc), XDP_PGOFF_TX_RING)) {
+        return -1;
+    }
+
+    /*
+     * The first half of the UMEM is given to the kernel for RX and the
+     * second half is kept for TX.
+     */
+    rx_frame_nr = ulmin(frame_nr / 2, ring_size);
+    fill = eth->ex_fill.desc;
+    for (size_t i = 0; i < rx_frame_nr; i++) {
+        fill[eth->ex_fill.cached_prod++ & eth->ex_fill.mask] = i * frame_size;
+    }
+    xdp_ring_prod_submit(&eth->ex_fill);
+
+    eth->ex_tx_free = malloc((frame_nr - rx_frame_nr) * sizeof(uint64_t));
+    if (!eth->ex_tx_free) {
+        return -1;
+    }
+    for (size_t i = rx_frame_nr; i < frame_nr; i++) {
+        eth->ex_tx_free[eth->ex_tx_free_nr++] = i * frame_size;
+    }
+
+    return 0;
+}
+
+static void xdp_ether_umem_deinit(struct ether_xdp * eth)
+{
+    xdp_ring_unmap(&eth->ex_tx);
+    xdp_ring_unmap(&eth->ex_rx);
+    xdp_ring_unmap(&eth->ex_comp);
+    xdp_ring_unmap(&eth->ex_fill);
+    free(eth->ex_tx_free);
+    eth->ex_tx_free = NULL;
+    if (eth->ex_umem) {
+        munmap(eth->ex_umem, eth->ex_umem_len);
+        eth->ex_umem = NULL;
+    }
+}
+
+/*
+ * Instruction indices of the XDP program.
+ */
+#define XDP_INSN_MAC_LO     11  /* if w4 != mac[0..3] */
+#define XDP_INSN_MAC_HI     12  /* if w5 == mac[4..5] */
+#define XDP_INSN_MAP        16  /* r1 = map */
+#define XDP_INSN_PASS       21  /* return XDP_PASS */
+
+/**
+ * Load and attach an XDP program redirecting the frames received on the
+ * queue to our socket.
+ * Only ARP and IPv4 frames sent to our MAC address or broadcast are
+ * redirected, everything else, as well as frames on other queues or arriving
+ * before the socket is in the map, are passed on to the kernel stack.
+ */
+static int xdp_ether_prog_init(struct ether_xdp * eth)
+{
+    union bpf_attr attr;
+    int key = eth->ex_queue;
+    int value = eth->ex_fd;
+    uint32_t mac_lo;
+    uint16_t mac_hi;
+    struct bpf_insn insns[] = {
+        /* 0: r6 = ctx */
+        {
+            .code = BPF_ALU64 | BPF_MOV | BPF_X,
+            .dst_reg = BPF_REG_6,
+            .src_reg = BPF_REG_1,
+        },
+        /* 1: r2 = ctx->data */
+        {
+            .code = BPF_LDX | BPF_MEM | BPF_W,
+            .dst_reg = BPF_REG_2,
+            .src_reg = BPF_REG_1,
+            .off = offsetof(struct xdp_md, data),
+        },
+        /* 2: r3 = ctx->data_end */
+        {
+            .code = BPF_LDX | BPF_MEM | BPF_W,
+            .dst_reg = BPF_REG_3,
+            .src_reg = BPF_REG_1,
+            .off = offsetof(struct xdp_md, data_end),
+        },
+        /* 3: r4 = r2 + ETHER_HEADER_LEN */
+        {
+            .code = BPF_ALU64 | BPF_MOV | BPF_X,
+            .dst_reg = BPF_REG_4,
+            .src_reg = BPF_REG_2,
+        },
+        {
+            .code = BPF_ALU64 | BPF_ADD | BPF_K,
+            .dst_reg = BPF_REG_4,
+            .imm = ETHER_HEADER_LEN,
+        },
+        /* 5: if r4 > r3 goto pass */
+        {
+            .code = BPF_JMP | BPF_JGT | BPF_X,
+            .dst_reg = BPF_REG_4,
+            .src_reg = BPF_REG_3,
+            .off = XDP_INSN_PASS - 6,
+        },
+        /* 6: r4 = h_proto */
+        {
+            .code = BPF_LDX | BPF_MEM | BPF_H,
+            .dst_reg = BPF_REG_4,
+            .src_reg = BPF_REG_2,
+            .off = offsetof(struct ether_hdr, h_proto),
+        },
+        /* 7: if w4 == IPv4 goto 9 */
+        {
+            .code = BPF_JMP32 | BPF_JEQ | BPF_K,
+            .dst_reg = BPF_REG_4,
+            .off = 1,
+            .imm = htons(ETHER_PROTO_IPV4),
+        },
+        /* 8: if w4 != ARP goto pass */
+        {
+            .code = BPF_JMP32 | BPF_JNE | BPF_K,
+            .dst_reg = BPF_REG_4,
+            .off = XDP_INSN_PASS - 9,
+            .imm = htons(ETHER_PROTO_ARP),
+        },
+        /* 9: r4 = h_dst[0..3], r5 = h_dst[4..5] */
+        {
+            .code = BPF_LDX | BPF_MEM | BPF_W,
+            .dst_reg = BPF_REG_4,
+            .src_reg = BPF_REG_2,
+            .off = offsetof(struct ether_hdr, h_dst),
+        },
+        {
+            .code = BPF_LDX | BPF_MEM | BPF_H,
+            .dst_reg = BPF_REG_5,
+            .src_reg = BPF_REG_2,
+            .off = offsetof(struct ether_hdr, h_dst) + 4,
+        },
+        /* 11: if w4 != mac[0..3] goto 13 */
+        {
+            .code = BPF_JMP32 | BPF_JNE | BPF_K,
+            .dst_reg = BPF_REG_4,
+            .off = 1,
+            .imm = 0, /* Set below */
+        },
+        /* 12: if w5 == mac[4..5] goto redirect */
+        {
+            .code = BPF_JMP32 | BPF_JEQ | BPF_K,
+            .dst_reg = BPF_REG_5,
+            .off = 2,
+            .imm = 0, /* Set below */
+        },
+        /* 13: if h_dst != broadcast goto pass */
+        {
+            .code = BPF_JMP32 | BPF_JNE | BPF_K,
+            .dst_reg = BPF_REG_4,
+            .off = XDP_INSN_PASS - 14,
+            .imm = -1,
+        },
+        {
+            .code = BPF_JMP32 | BPF_JNE | BPF_K,
+            .dst_reg = BPF_REG_5,
+            .off = XDP_INSN_PASS - 15,
+            .imm = 0xffff,
+        },
+        /* 15: redirect: r2 = ctx->rx_queue_index */
+        {
+            .code = BPF_LDX | BPF_MEM | BPF_W,
+            .dst_reg = BPF_REG_2,
+            .src_reg = BPF_REG_6,
+            .off = offsetof(struct xdp_md, rx_queue_index),
+        },
+        /* 16: r1 = map */
+        {
+            .code = BPF_LD | BPF_DW | BPF_IMM,
+            .dst_reg = BPF_REG_1,
+            .src_reg = BPF_PSEUDO_MAP_FD,
+            .imm = 0, /* Set below */
+        },
+        { 0 },
+        /* 18: r3 = XDP_PASS */
+        {
+            .code = BPF_ALU64 | BPF_MOV | BPF_K,
+            .dst_reg = BPF_REG_3,
+            .imm = XDP_PASS,
+        },
+        /* 19: return bpf_redirect_map(map, r2, XDP_PASS) */
+        {
+            .code = BPF_JMP | BPF_CALL,
+            .imm = BPF_FUNC_redirect_map,
+        },
+        {
+            .code = BPF_JMP | BPF_EXIT,
+        },
+        /* 21: pass: return XDP_PASS */
+        {
+            .code = BPF_ALU64 | BPF_MOV | BPF_K,
+            .dst_reg = BPF_REG_0,
+            .imm = XDP_PASS,
+        },
+        {
+            .code = BPF_JMP | BPF_EXIT,
+        },
+    };
+
+    /* The program loads the address in host order. */
+    memcpy(&mac_lo, eth->ex_mac, sizeof(mac_lo));
+    memcpy(&mac_hi, eth->ex_mac + sizeof(mac_lo), sizeof(mac_hi));
+    insns[XDP_INSN_MAC_LO].imm = (int32_t)mac_lo;
+    insns[XDP_INSN_MAC_HI].imm = mac_hi;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = XDP_MAX_QUEUES;
+    if ((eth->ex_map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) == -1) {
+        return -1;
+    }
+    insns[XDP_INSN_MAP].imm = eth->ex_map_fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uintptr_t)insns;
+    attr.insn_cnt = num_elem(insns);
+    attr.license = (uintptr_t)"BSD";
+    if ((eth->ex_prog_fd = sys_bpf(BPF_PROG_LOAD, &attr)) == -1) {
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = eth->ex_map_fd;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&value;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = eth->ex_prog_fd;
+    attr.link_create.target_ifindex = eth->ex_ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = (eth->ex_drv_mode) ? XDP_FLAGS_DRV_MODE :
+                                                  XDP_FLAGS_SKB_MODE;
+    if ((eth->ex_link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void xdp_ether_prog_deinit(struct ether_xdp * eth)
+{
+    /* Closing the link detaches the program. */
+    if (eth->ex_link_fd >= 0) {
+        close(eth->ex_link_fd);
+        eth->ex_link_fd = -1;
+    }
+    if (eth->ex_prog_fd >= 0) {
+        close(eth->ex_prog_fd);
+        eth->ex_prog_fd = -1;
+    }
+    if (eth->ex_map_fd >= 0) {
+        close(eth->ex_map_fd);
+        eth->ex_map_fd = -1;
+    }
+}
+
+static int xdp_ether_parse_opt(struct ether_xdp * eth, const char * opt)
+{
+    const char * value;
+
+    if ((value = ether_opt_value(opt, "queue"))) {
+        eth->ex_queue = atoi(value);
+        if (eth->ex_queue < 0 || eth->ex_queue >= XDP_MAX_QUEUES) {
+            errno = EINVAL;
+            return -1;
+        }
+    } else if ((value = ether_opt_value(opt, "mode"))) {
+        if (!strcmp(value, "skb")) {
+            eth->ex_drv_mode = 0;
+        } else if (!strcmp(value, "native")) {
+            eth->ex_drv_mode = 1;
+        } else {
+            errno = EINVAL;
+            return -1;
+        }
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int xdp_ether_init(char * const args[])
+{
+    const int handle = ether_next_handle;
+    struct ether_xdp * eth;
+    char if_name[IFNAMSIZ];
+    struct sockaddr_xdp sxdp;
+
+    if (handle >= ETHER_MAX_IF) {
+        errno = EAGAIN;
+        return -1;
+    }
+    eth = &ether_if[handle];
+    ether_next_handle++;
+    eth->ex_map_fd = -1;
+    eth->ex_prog_fd = -1;
+    eth->ex_link_fd = -1;
+
+    if (args[0]) { /* Non-default IF */
+        strncpy(if_name, args[0], IFNAMSIZ - 1);
+        if_name[IFNAMSIZ - 1] = '\0';
+
+        for (size_t i = 1; args[i]; i++) {
+            if (xdp_ether_parse_opt(eth, args[i])) {
+                return -1;
+            }
+        }
+    } else { /* Default IF */
+        strcpy(if_name, DEFAULT_IF);
+    }
+
+    if ((eth->ex_ifindex = if_nametoindex(if_name)) == 0) {
+        return -1;
+    }
+
+    if (xdp_ether_get_hwaddr(eth, if_name)) {
+        return -1;
+    }
+
+    if ((eth->ex_fd = socket(AF_XDP, SOCK_RAW, 0)) == -1) {
+        return -1;
+    }
+
+    if (xdp_ether_umem_init(eth)) {
+        goto fail;
+    }
+
+    /*
+     * The native mode lets the kernel pick zero-copy if the NIC driver
+     * supports it; the SKB mode only works in copy mode.
+     */
+    sxdp = (struct sockaddr_xdp){
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = eth->ex_ifindex,
+        .sxdp_queue_id = eth->ex_queue,
+        .sxdp_flags = (eth->ex_drv_mode) ? 0 : XDP_COPY,
+    };
+    if (bind(eth->ex_fd, (struct sockaddr *)&sxdp, sizeof(sxdp))) {
+        goto fail;
+    }
+
+    if (xdp_ether_prog_init(eth)) {
+        LOG(LOG_ERR, "Failed to attach an XDP program");
+        goto fail;
+    }
+
+    if (pthread_mutex_init(&eth->ex_tx_lock, NULL)) {
+        goto fail;
+    }
+
+    return handle;
+fail:
+    xdp_ether_prog_deinit(eth);
+    close(eth->ex_fd);
+    xdp_ether_umem_deinit(eth);
+    return -1;
+}
+
+static void xdp_ether_deinit(int handle)
+{
+    struct ether_xdp * eth;
+
+    if (!(eth = ether_handle2eth(handle))) {
+        return;
+    }
+
+    xdp_ether_prog_deinit(eth);
+    close(eth->ex_fd);
+    xdp_ether_umem_deinit(eth);
+    pthread_mutex_destroy(&eth->ex_tx_lock);
+}
+
+/**
+ * Give the frames lent to the caller back to the kernel.
+ */
+static void rx_return_lent(struct ether_xdp * eth)
+{
+    struct xdp_ring * fill = &eth->ex_fill;
+    size_t n = eth->ex_rx_lent_nr;
+
+    if (n == 0) {
+        return;
+    }
+
+    /* The fill ring can hold all RX frames so this never fails. */
+    n = ulmin(n, xdp_ring_prod_free(fill));
+    for (size_t i = 0; i < n; i++) {
+        ((uint64_t *)fill->desc)[fill->cached_prod++ & fill->mask] =
+            eth->ex_rx_lent[i];
+    }
+    xdp_ring_prod_submit(fill);
+    eth->ex_rx_lent_nr = 0;
+}
+
+static int xdp_ether_receive_burst(int handle, struct ether_frame * frames,
+                                   size_t nr)
+{
+    struct ether_xdp * eth;
+    struct xdp_ring * rx;
+    size_t out = 0;
+
+    if (!(eth = ether_handle2eth(handle))) {
+        return -1;
+    }
+    rx = &eth->ex_rx;
+    nr = ulmin(nr, XSTACK_ETHER_RX_BURST);
+
+    do {
+        uint32_t avail;
+
+        rx_return_lent(eth);
+
+        while ((avail = xdp_ring_cons_avail(rx)) == 0) {
+            struct pollfd pfd = {
+                .fd = eth->ex_fd,
+                .events = POLLIN,
+            };
+            int retval;
+
+            retval = poll(&pfd, 1, XSTACK_PERIODIC_EVENT_SEC * 1000);
+            if (retval == 0 || (retval == -1 && errno == EINTR)) {
+                return 0;
+            } else if (retval == -1) {
+                return -1;
+            }
+        }
+
+        for (size_t i = ulmin(avail, nr); i > 0; i--) {
+            const struct xdp_desc * desc;
+            struct ether_hdr * frame_hdr;
+            struct ether_frame * f = &frames[out];
+            uint8_t * frame;
+
+            desc = &((struct xdp_desc *)rx->desc)[rx->cached_cons++ &
+                                                   rx->mask];
+            eth->ex_rx_lent[eth->ex_rx_lent_nr++] = desc->addr;
+            if (desc->len < ETHER_HEADER_LEN) {
+                continue;
+            }
+
+            /*
+             * A frame always owns a whole UMEM chunk so there is enough
+             * room after the frame for a reply longer than the frame itself.
+             */
+            frame = eth->ex_umem + desc->addr;
+            frame_hdr = (struct ether_hdr *)frame;
+            memcpy(f->hdr.h_dst, frame_hdr->h_dst, sizeof(mac_addr_t));
+            memcpy(f->hdr.h_src, frame_hdr->h_src, sizeof(mac_addr_t));
+            f->hdr.h_proto = ntohs(frame_hdr->h_proto);
+            f->payload = frame + ETHER_HEADER_LEN;
+            f->bsize = desc->len - ETHER_HEADER_LEN;
+            f->flags = 0;
+            out++;
+        }
+        xdp_ring_cons_release(rx);
+    } while (out == 0);
+
+    return (int)out;
+}
+
+/**
+ * Kick the kernel to transmit all frames queued in the TX ring.
+ */
+static int tx_kick(struct ether_xdp * eth)
+{
+    eth->ex_tx_pending = 0;
+    if (sendto(eth->ex_fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 &&
+        errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Move completed TX frames back to the free list.
+ */
+static void tx_reclaim(struct ether_xdp * eth)
+{
+    struct xdp_ring * comp = &eth->ex_comp;
+    uint32_t n;
+
+    n = xdp_ring_cons_avail(comp);
+    if (n == 0) {
+        return;
+    }
+
+    while (n--) {
+        eth->ex_tx_free[eth->ex_tx_free_nr++] =
+            ((uint64_t *)comp->desc)[comp->cached_cons++ & comp->mask];
+    }
+    xdp_ring_cons_release(comp);
+}
+
+static uint8_t * xdp_ether_tx_alloc(int handle)
+{
+    struct ether_xdp * eth;
+
+    if (!(eth = ether_handle2eth(handle))) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&eth->ex_tx_lock);
+    tx_reclaim(eth);
+    if (eth->ex_tx_free_nr == 0 || xdp_ring_prod_free(&eth->ex_tx) == 0) {
+        /* Everything is in flight, wait until the kernel has drained it. */
+        if (tx_kick(eth)) {
+            pthread_mutex_unlock(&eth->ex_tx_lock);
+            return NULL;
+        }
+        tx_reclaim(eth);
+        if (eth->ex_tx_free_nr == 0 || xdp_ring_prod_free(&eth->ex_tx) == 0) {
+            pthread_mutex_unlock(&eth->ex_tx_lock);
+            errno = ENOBUFS;
+            return NULL;
+        }
+    }
+    eth->ex_tx_frame = eth->ex_tx_free[--eth->ex_tx_free_nr];
+
+    return eth->ex_umem + eth->ex_tx_frame + ETHER_HEADER_LEN;
+}
+
+static void xdp_ether_tx_abort(int handle)
+{
+    struct ether_xdp * eth = ether_handle2eth(handle);
+
+    eth->ex_tx_free[eth->ex_tx_free_nr++] = eth->ex_tx_frame;
+    pthread_mutex_unlock(&eth->ex_tx_lock);
+}
+
+static int xdp_ether_tx_commit(int handle, const mac_addr_t dst,
+                               uint16_t proto, size_t bsize)
+{
+    struct ether_xdp * eth = ether_handle2eth(handle);
+    struct xdp_ring * tx = &eth->ex_tx;
+    const size_t frame_size = ETHER_HEADER_LEN +
+                              max(bsize, ETHER_MINLEN - ETHER_HEADER_LEN) +
+                              ETHER_TX_FCS_LEN;
+    uint8_t * frame = eth->ex_umem + eth->ex_tx_frame;
+    uint8_t * data = frame + ETHER_HEADER_LEN;
+    struct ether_hdr * frame_hdr = (struct ether_hdr *)frame;
+    struct xdp_desc * desc;
+#if XSTACK_ETHER_SW_FCS
+    uint32_t fcs;
+#endif
+    int retval = (int)frame_size;
+
+    if (frame_size > ETHER_MAXLEN + ETHER_TX_FCS_LEN) {
+        xdp_ether_tx_abort(handle);
+        return -EMSGSIZE;
+    }
+
+    memcpy(frame_hdr->h_dst, dst, ETHER_ALEN);
+    memcpy(frame_hdr->h_src, eth->ex_mac, ETHER_ALEN);
+    frame_hdr->h_proto = htons(proto);
+    memset(data + bsize, 0, frame_size - ETHER_HEADER_LEN - bsize);
+#if XSTACK_ETHER_SW_FCS
+    fcs = ether_fcs(frame, frame_size - ETHER_FCS_LEN);
+    memcpy(frame + frame_size - ETHER_FCS_LEN, &fcs, sizeof(uint32_t));
+#endif
+
+    /* A TX descriptor was reserved by xdp_ether_tx_alloc(). */
+    desc = &((struct xdp_desc *)tx->desc)[tx->cached_prod++ & tx->mask];
+    desc->addr = eth->ex_tx_frame;
+    desc->len = frame_size;
+    desc->options = 0;
+    xdp_ring_prod_submit(tx);
+
+    if (++eth->ex_tx_pending >= XSTACK_ETHER_TX_BATCH && tx_kick(eth)) {
+        retval = -errno;
+    }
+
+    pthread_mutex_unlock(&eth->ex_tx_lock);
+    return retval;
+}
+
+static int xdp_ether_tx_flush(int handle)
+{
+    struct ether_xdp * eth;
+    int retval = 0;
+
+    if (!(eth = ether_handle2eth(handle))) {
+        return -errno;
+    }
+
+    pthread_mutex_lock(&eth->ex_tx_lock);
+    if (eth->ex_tx_pending > 0 && tx_kick(eth)) {
+        retval = -errno;
+    }
+    pthread_mutex_unlock(&eth->ex_tx_lock);
+
+    return retval;
+}
+
+static struct ether_driver xdp_ether_driver = {
+    .name = "xdp",
+    .init = xdp_ether_init,
+    .deinit = xdp_ether_deinit,
+    .handle2addr = xdp_ether_handle2addr,
+    .receive_burst = xdp_ether_receive_burst,
+    .tx_alloc = xdp_ether_tx_alloc,
+    .tx_commit = xdp_ether_tx_commit,
+    .tx_abort = xdp_ether_tx_abort,
+    .tx_flush = xdp_ether_tx_flush,
+};
+ETHER_DRIVER(xdp_ether_driver);
@@ -376,6 +376,10 @@ struct {                                                                \
  * List functions.
  */
 
+#define        QMD_LIST_CHECK_HEAD(head, field)
+#define        QMD_LIST_CHECK_NEXT(elm, field)
+#define        QMD_LIST_CHECK_PREV(elm, field)
+
 #define        LIST_EMPTY(head)        ((head)->lh_first == NULL)
 
 #define        LIST_FIRST(head)        ((head)->lh_first)
@@ -481,6 +485,11 @@ struct {                                                                \
 /*
  * Tail queue functions.
  */
+
+#define        QMD_TAILQ_CHECK_HEAD(head, field)
+#define        QMD_TAILQ_CHECK_TAIL(head, headname)
+#define        QMD_TAILQ_CHECK_NEXT(elm, field)
+#define        QMD_TAILQ_CHECK_PREV(elm, field)
 #define        TAILQ_CONCAT(head1, head2, field) do {                                \
         if (!TAILQ_EMPTY(head2)) {                                        \
                 *(head1)->tqh_last = (head2)->tqh_first;                \
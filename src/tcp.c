@@ -5,6 +5,7 @@
 #include "xstack_ip.h"
 #include "xstack_socket.h"
 
+#include "ip_dst.h"
 #include "logger.h"
 #include "queue.h"
 #include "tcp.h"
@@ -14,6 +15,14 @@
 #define TCP_TIMER_MS            250
 #define TCP_FIN_WAIT_TIMEOUT_MS 20000
 #define TCP_SYN_RCVD_TIMEOUT_MS 20000
+#define TCP_MSS_DEFAULT         536 /* Assumed if the peer doesn't tell. */
+
+/*
+ * TCP Option Kinds.
+ */
+#define TCP_OPT_END             0
+#define TCP_OPT_NOP             1
+#define TCP_OPT_MSS             2
 
 /*
  * TCP Connection Flags.
@@ -119,50 +128,13 @@ static uint16_t tcp_checksum(const struct xstack_sockaddr * restrict src,
                              const struct xstack_sockaddr * restrict dst,
                              struct tcp_hdr * restrict dp, size_t bsize)
 {
-    const uint8_t * restrict data = (uint8_t *)dp;
-    uint32_t acc = 0xffff;
-    size_t i;
-    uint16_t word;
-    struct {
-        uint32_t src_addr;
-        uint32_t dst_addr;
-        uint8_t zeros;
-        uint8_t proto;
-        uint16_t tcp_len;
-    } __attribute__((packed, aligned(4))) pseudo_header = {
-        .src_addr = htonl(src->inet4_addr),
-        .dst_addr = htonl(dst->inet4_addr),
-        .zeros = 0,
-        .proto = IP_PROTO_TCP,
-        .tcp_len = htons(bsize),
-    };
-
-    for (i = 0; i + 1 < 12; i += 2) {
-        memcpy(&word, (uint8_t *)(&pseudo_header) + i, 2);
-        acc += word;
-        if (acc > 0xffff) {
-            acc -= ntohs(0xffff);
-        }
-    }
-
-    for (i = 0; i + 1 < bsize; i += 2) {
-        memcpy(&word, data + i, 2);
-        acc += word;
-        if (acc > 0xffff) {
-            acc -= ntohs(0xffff);
-        }
-    }
+    uint32_t sum;
 
-    if (bsize & 1) {
-        word = 0;
-        memcpy(&word, data + bsize - 1, 1);
-        acc += word;
-        if (acc > 0xffff) {
-            acc -= ntohs(0xffff);
-        }
-    }
+    sum = ip_checksum_pseudo(src->inet4_addr, dst->inet4_addr, IP_PROTO_TCP,
+                             bsize);
+    sum = ip_checksum_partial(dp, bsize, sum);
 
-    return ~acc;
+    return ip_checksum_fold(sum);
 }
 
 static void tcp_hton(const struct xstack_sockaddr * restrict src,
@@ -194,6 +166,49 @@ static void tcp_ntoh(const struct tcp_hdr * net, struct tcp_hdr * host)
     /* TODO Handle opts */
 }
 
+/**
+ * Clamp the MSS of a received SYN to the path MTU towards the peer.
+ * The options of the SYN are echoed back in the SYN-ACK so the clamped
+ * value is also what we announce.
+ */
+static void tcp_clamp_mss(struct tcp_conn_tcb * conn, struct tcp_hdr * syn)
+{
+    const struct ip_dst * dst_entry = ip_dst_get(conn->remote.inet4_addr);
+    const size_t mtu = (dst_entry) ? dst_entry->mtu : ETHER_DATA_LEN;
+    const size_t max_mss = mtu - sizeof(struct ip_hdr) - sizeof(struct tcp_hdr);
+    const int hlen = tcp_hdr_size(syn);
+    size_t i = 0;
+
+    conn->mss = min(TCP_MSS_DEFAULT, max_mss);
+    if (hlen < 0) {
+        return;
+    }
+
+    while (i < hlen - sizeof(struct tcp_hdr)) {
+        uint8_t * opt = syn->opt + i;
+        const size_t left = hlen - sizeof(struct tcp_hdr) - i;
+        size_t len;
+
+        if (opt[0] == TCP_OPT_END) {
+            break;
+        } else if (opt[0] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (left < 2 || (len = opt[1]) < 2 || len > left) {
+            break;
+        }
+        if (opt[0] == TCP_OPT_MSS && len == 4) {
+            const size_t mss = min((opt[2] << 8) | opt[3], max_mss);
+
+            opt[2] = mss >> 8;
+            opt[3] = mss & 0xff;
+            conn->mss = mss;
+        }
+        i += len;
+    }
+}
+
 static int tcp_fsm(struct tcp_conn_tcb * conn, struct tcp_hdr * rs)
 {
     switch (conn->state) {
@@ -207,6 +222,8 @@ static int tcp_fsm(struct tcp_conn_tcb * conn, struct tcp_hdr * rs)
         if (rs->tcp_flags & TCP_SYN) {
             LOG(LOG_INFO, "SYN received");
 
+            tcp_clamp_mss(conn, rs);
+
             rs->tcp_flags |= TCP_ACK;
             rs->tcp_ack_num = rs->tcp_seqno + 1;
             rs->tcp_seqno = 0; /* TODO Randomize */
@@ -303,6 +320,14 @@ static int tcp_input(const struct ip_hdr * ip_hdr, uint8_t * payload, size_t bsi
 
     tcp_ntoh(tcp, tcp);
 
+    /* The options are parsed in place so the header must fit in bsize. */
+    const int hlen = tcp_hdr_size(tcp);
+    if (hlen < 0 || (size_t)hlen > bsize) {
+        LOG(LOG_INFO, "Invalid header size");
+
+        return -EBADMSG;
+    }
+
     struct tcp_conn_tcb * conn = tcp_find_connection(&attr);
     if (!conn && (tcp->tcp_flags & TCP_SYN)) { /* New connection */
         char rem_str[IP_STR_LEN];
@@ -317,8 +342,8 @@ static int tcp_input(const struct ip_hdr * ip_hdr, uint8_t * payload, size_t bsi
         /* TODO Check if we listen the port */
         conn = tcp_new_connection(&attr);
         conn->state = TCP_LISTEN;
-    } else if (!conn || (tcp->tcp_flags & TCP_SYN) || tcp_hdr_size(tcp) < 0) {
-        /* No connection initiated, invalid flag, or invalid header size. */
+    } else if (!conn || (tcp->tcp_flags & TCP_SYN)) {
+        /* No connection initiated or invalid flag. */
         return -EINVAL; /* TODO any other error handling needed here? */
     }
 
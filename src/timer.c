@@ -0,0 +1,255 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "xstack_util.h"
+
+#include "timer.h"
+
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SIZE    (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS  4
+/* The longest time a timer can be placed in the wheel at once [ms]. */
+#define TIMER_WHEEL_SPAN    ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+LIST_HEAD(timer_list, timer);
+
+/*
+ * Level n of the wheel has slots of 64^n ms. A timer is placed on the lowest
+ * level that covers its expiration time and moved down a level each time
+ * the lower level wraps around.
+ */
+static struct timer_list timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+static uint64_t timer_wheel_time;   /*!< The next ms to be run. */
+static size_t timer_count;          /*!< Number of pending timers. */
+static uint64_t timer_deadline = UINT64_MAX; /*!< Sleeping until [ms]. */
+static void (*timer_wakeup)(void);
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t timer_run_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t timer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline unsigned timer_level_shift(int level)
+{
+    return TIMER_WHEEL_BITS * level;
+}
+
+/**
+ * Place a timer in the wheel.
+ * Timers that already expired go to the slot run next.
+ */
+static void timer_add(struct timer * timer)
+{
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    int level;
+
+    if (expires < timer_wheel_time) {
+        expires = timer_wheel_time;
+    }
+    delta = expires - timer_wheel_time;
+    if (delta >= TIMER_WHEEL_SPAN) {
+        /* Placed again when the slot is cascaded. */
+        expires = timer_wheel_time + TIMER_WHEEL_SPAN - 1;
+        delta = TIMER_WHEEL_SPAN - 1;
+    }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < ((uint64_t)1 << timer_level_shift(level + 1))) {
+            break;
+        }
+    }
+
+    LIST_INSERT_HEAD(&timer_wheel[level][(expires >> timer_level_shift(level)) &
+                                         TIMER_WHEEL_MASK],
+                     timer, _entry);
+}
+
+static void timer_remove(struct timer * timer)
+{
+    LIST_REMOVE(timer, _entry);
+    timer->pending = 0;
+    timer_count--;
+}
+
+/**
+ * Move the timers of the current slot of a level to the lower levels.
+ * @returns the index of the slot.
+ */
+static unsigned timer_cascade(int level)
+{
+    const unsigned i = (timer_wheel_time >> timer_level_shift(level)) &
+                       TIMER_WHEEL_MASK;
+    struct timer_list list = LIST_HEAD_INITIALIZER(list);
+    struct timer * timer;
+
+    LIST_SWAP(&list, &timer_wheel[level][i], timer, _entry);
+    while ((timer = LIST_FIRST(&list))) {
+        LIST_REMOVE(timer, _entry);
+        timer_add(timer);
+    }
+
+    return i;
+}
+
+/**
+ * Get the time when the next timer expires or a slot with timers is
+ * cascaded.
+ */
+static uint64_t timer_next(void)
+{
+    uint64_t next = UINT64_MAX;
+
+    if (timer_count == 0) {
+        return next;
+    }
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        const unsigned shift = timer_level_shift(level);
+        const uint64_t base = timer_wheel_time >> shift;
+
+        for (unsigned k = 0; k < TIMER_WHEEL_SIZE; k++) {
+            uint64_t t;
+
+            if (LIST_EMPTY(&timer_wheel[level][(base + k) & TIMER_WHEEL_MASK])) {
+                continue;
+            }
+
+            t = (base + k) << shift;
+            if (t < timer_wheel_time) {
+                /* The current slot was cascaded, it's next due after a wrap. */
+                t += (uint64_t)TIMER_WHEEL_SIZE << shift;
+                next = (t < next) ? t : next;
+                continue;
+            }
+            next = (t < next) ? t : next;
+            break;
+        }
+    }
+
+    return next;
+}
+
+void timer_init(struct timer * timer, timer_fn_t * fn)
+{
+    timer->fn = fn;
+    timer->pending = 0;
+}
+
+void timer_arm(struct timer * timer, unsigned ms)
+{
+    const uint64_t now = timer_now();
+    int wakeup = 0;
+
+    pthread_mutex_lock(&timer_lock);
+
+    if (timer->pending) {
+        timer_remove(timer);
+    }
+    if (timer_count == 0 && timer_wheel_time < now) {
+        /* The wheel is idle, there is nothing to run up to now. */
+        timer_wheel_time = now;
+    }
+    timer->expires = now + ms;
+    timer->pending = 1;
+    timer_count++;
+    timer_add(timer);
+
+    if (timer->expires < timer_deadline) {
+        timer_deadline = timer->expires;
+        wakeup = 1;
+    }
+
+    pthread_mutex_unlock(&timer_lock);
+
+    if (wakeup && timer_wakeup) {
+        timer_wakeup();
+    }
+}
+
+void timer_cancel(struct timer * timer)
+{
+    pthread_mutex_lock(&timer_lock);
+    if (timer->pending) {
+        timer_remove(timer);
+    }
+    pthread_mutex_unlock(&timer_lock);
+}
+
+int timer_pending(const struct timer * timer)
+{
+    return __atomic_load_n(&timer->pending, __ATOMIC_RELAXED);
+}
+
+unsigned timer_run(unsigned max_ms)
+{
+    uint64_t now, next;
+
+    /* Only one thread runs the timers, the other one can retry soon. */
+    if (pthread_mutex_trylock(&timer_run_lock)) {
+        return min(max_ms, 1);
+    }
+
+    now = timer_now();
+    pthread_mutex_lock(&timer_lock);
+
+    if (timer_count == 0) {
+        timer_wheel_time = now + 1;
+    }
+
+    while (timer_wheel_time <= now) {
+        struct timer_list list = LIST_HEAD_INITIALIZER(list);
+        struct timer * timer;
+        unsigned i;
+
+        /* Cascade the upper levels when the lower level wraps around. */
+        i = timer_wheel_time & TIMER_WHEEL_MASK;
+        for (int level = 1; i == 0 && level < TIMER_WHEEL_LEVELS; level++) {
+            i = timer_cascade(level);
+        }
+
+        LIST_SWAP(&list, &timer_wheel[0][timer_wheel_time & TIMER_WHEEL_MASK],
+                  timer, _entry);
+        timer_wheel_time++;
+
+        while ((timer = LIST_FIRST(&list))) {
+            if (timer->expires >= timer_wheel_time) {
+                /* Clamped to the span of the wheel. */
+                LIST_REMOVE(timer, _entry);
+                timer_add(timer);
+                continue;
+            }
+
+            timer_remove(timer);
+            pthread_mutex_unlock(&timer_lock);
+            timer->fn(timer);
+            pthread_mutex_lock(&timer_lock);
+        }
+    }
+
+    next = timer_next();
+    now = timer_now();
+    if (next <= now) {
+        next = now;
+    } else if (next - now > max_ms) {
+        next = now + max_ms;
+    }
+    timer_deadline = next;
+
+    pthread_mutex_unlock(&timer_lock);
+    pthread_mutex_unlock(&timer_run_lock);
+
+    return (unsigned)(next - now);
+}
+
+void timer_set_wakeup(void (*wakeup)(void))
+{
+    timer_wakeup = wakeup;
+}
@@ -0,0 +1,83 @@
+/**
+ * @addtogroup timer
+ * Timers.
+ * Timers are kept in a hierarchical timing wheel with a resolution of one
+ * millisecond. Arming and canceling a timer are O(1). The expired timers are
+ * run by the ingress and egress threads, never concurrently.
+ * @{
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#include "queue.h"
+
+struct timer;
+
+/**
+ * Timer callback.
+ * The callback may arm the timer again.
+ */
+typedef void timer_fn_t(struct timer * timer);
+
+/**
+ * A timer.
+ * Usually embedded in the object the timer belongs to, the callback can get
+ * the object with container_of().
+ */
+struct timer {
+    LIST_ENTRY(timer) _entry;
+    uint64_t expires;       /*!< Expiration time [ms]. */
+    timer_fn_t * fn;        /*!< Called when the timer expires. */
+    int pending;            /*!< Set while the timer is armed. */
+};
+
+/**
+ * Initialize a timer.
+ */
+void timer_init(struct timer * timer, timer_fn_t * fn);
+
+/**
+ * Arm a timer to expire after ms milliseconds.
+ * A pending timer is rearmed.
+ */
+void timer_arm(struct timer * timer, unsigned ms);
+
+/**
+ * Cancel a timer.
+ * @note The callback may still run once if the timer already expired and
+ *       the callback is being run by another thread.
+ */
+void timer_cancel(struct timer * timer);
+
+/**
+ * Test if a timer is pending.
+ */
+int timer_pending(const struct timer * timer);
+
+/**
+ * Get the current time of the timer clock [ms].
+ */
+uint64_t timer_now(void);
+
+/**
+ * Run the expired timers.
+ * @param max_ms is the maximum return value.
+ * @returns the time until the next timer expires [ms].
+ */
+unsigned timer_run(unsigned max_ms);
+
+/**
+ * Set a function to be called when a timer is armed to expire before the
+ * time returned by the last timer_run() call, ie. the thread waiting for
+ * that time needs to wake up earlier.
+ */
+void timer_set_wakeup(void (*wakeup)(void));
+
+#endif /* TIMER_H */
+
+/**
+ * @}
+ */
@@ -8,6 +8,7 @@
 #include "xstack_socket.h"
 
 #include "ip_defer.h"
+#include "ip_dst.h"
 #include "logger.h"
 #include "udp.h"
 #include "xstack_arp.h"
@@ -134,24 +135,47 @@ IP_PROTO_INPUT_HANDLER(IP_PROTO_UDP, udp_input);
 int xstack_udp_send(struct xstack_sock * sock,
                     const struct xstack_dgram * dgram)
 {
-    uint8_t buf[sizeof(struct udp_hdr) + dgram->buf_size];
-    struct udp_hdr * udp = (struct udp_hdr *)buf;
-    uint8_t * payload = udp->data;
+    struct udp_hdr udp;
+    const struct iovec iov[] = {
+        { .iov_base = &udp, .iov_len = sizeof(udp) },
+        { .iov_base = (void *)dgram->buf, .iov_len = dgram->buf_size },
+    };
+    const size_t udp_len = sizeof(struct udp_hdr) + dgram->buf_size;
+    const struct ip_dst * dst_entry;
+    uint32_t sum;
 
     if (!(dgram->buf_size > 0 && dgram->buf_size < UDP_MAXLEN)) {
         return -EINVAL;
     }
 
+    /* The source address is needed for the pseudo header. */
+    dst_entry = ip_dst_get(dgram->dstaddr.inet4_addr);
+    if (!dst_entry) {
+        return -EHOSTUNREACH;
+    }
+
     /*
      * UDP Header.
      */
-    udp->udp_sport = sock->info.sock_addr.port;
-    udp->udp_dport = dgram->dstaddr.port;
-    udp->udp_len = sizeof(struct udp_hdr) + dgram->buf_size;
-    udp->udp_csum = 0; /* TODO calc UDP csum */
+    udp.udp_sport = sock->info.sock_addr.port;
+    udp.udp_dport = dgram->dstaddr.port;
+    udp.udp_len = udp_len;
+    udp.udp_csum = 0;
+    udp_hton(&udp, &udp);
 
-    memcpy(payload, dgram->buf, dgram->buf_size);
+    /*
+     * The payload is gathered straight from the socket buffer by IP so it's
+     * only read here for the checksum.
+     */
+    sum = ip_checksum_pseudo(dst_entry->src, dgram->dstaddr.inet4_addr,
+                             IP_PROTO_UDP, udp_len);
+    sum = ip_checksum_partial(&udp, sizeof(struct udp_hdr), sum);
+    sum = ip_checksum_partial(dgram->buf, dgram->buf_size, sum);
+    udp.udp_csum = ip_checksum_fold(sum);
+    if (udp.udp_csum == 0) {
+        udp.udp_csum = 0xffff; /* 0 means no checksum. */
+    }
 
-    udp_hton(udp, udp);
-    return ip_send(dgram->dstaddr.inet4_addr, IP_PROTO_UDP, buf, sizeof(buf));
+    return ip_sendv(dgram->dstaddr.inet4_addr, IP_PROTO_UDP, iov,
+                    num_elem(iov));
 }
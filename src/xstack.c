@@ -1,11 +1,14 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "linker_set.h"
@@ -15,6 +18,7 @@
 #include "logger.h"
 #include "queue.h"
 #include "tcp.h"
+#include "timer.h"
 #include "udp.h"
 #include "xstack_ether.h"
 #include "xstack_internal.h"
@@ -43,6 +47,10 @@ static xstack_send_fn * proto_send[] = {
     [XIP_PROTO_UDP] = xstack_udp_send,
 };
 
+static struct {
+    unsigned long dropped;
+} sock_stats;
+
 static struct xstack_sock sockets[] = {
     {
         .info.sock_dom = XF_INET4,
@@ -68,21 +76,6 @@ static void set_state(enum xstack_state state)
     xstack_state = state;
 }
 
-static int delta_time;
-static int eval_timer(void)
-{
-    static struct timespec start;
-    struct timespec now;
-
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    delta_time = now.tv_sec - start.tv_sec;
-    if (delta_time >= XSTACK_PERIODIC_EVENT_SEC) {
-        start = now;
-        return !0;
-    }
-    return 0;
-}
-
 /**
  * Bind an address to a socket.
  * @param[in] sock is a pointer to the socket returned by xstack_socket().
@@ -107,7 +100,19 @@ int xstack_sock_dgram_input(struct xstack_sock * sock,
     int dgram_index;
     struct xstack_dgram * dgram;
 
-    while ((dgram_index = queue_alloc(sock->ingress_q)) == -1);
+    /*
+     * A reassembled datagram may be larger than the ring could ever hold,
+     * waiting for room would hang the ingress thread.
+     */
+    if (bsize > XSTACK_DATAGRAM_SIZE_MAX ||
+        2 * (QUEUE_REC_HDR_SIZE + sizeof(*dgram) + bsize) > sock->ring_size) {
+        sock_stats.dropped++;
+        LOG(LOG_INFO, "Datagram too large for the socket: %zu", bsize);
+        return -EMSGSIZE;
+    }
+
+    while ((dgram_index = queue_rec_alloc(sock->ingress_q, sock->ingress_data,
+                                          sizeof(*dgram) + bsize)) == -1);
     dgram = (struct xstack_dgram *)(sock->ingress_data + dgram_index);
 
     dgram->srcaddr = *srcaddr;
@@ -115,8 +120,8 @@ int xstack_sock_dgram_input(struct xstack_sock * sock,
     dgram->buf_size = bsize;
     memcpy(dgram->buf, buf, bsize);
 
-    queue_commit(sock->ingress_q);
-    kill(sock->ctrl->pid_end, SIGUSR2);
+    queue_rec_commit(sock->ingress_q);
+    doorbell_ring(&sock->ctrl->ingress_bell);
 
     return 0;
 }
@@ -133,6 +138,30 @@ static void run_periodic_tasks(int delta_time)
     }
 }
 
+static struct timer periodic_timer;
+
+static void periodic_timer_fn(struct timer * timer)
+{
+    static uint64_t last;
+    const uint64_t now = timer_now();
+    const int delta_time = (last) ? (now - last) / 1000 :
+                                    XSTACK_PERIODIC_EVENT_SEC;
+
+    last = now;
+    timer_arm(timer, XSTACK_PERIODIC_EVENT_SEC * 1000);
+
+    LOG(LOG_DEBUG, "tick");
+    run_periodic_tasks(delta_time);
+}
+
+/**
+ * Wakeup the egress thread to run the timers.
+ */
+static void timer_wakeup_egress(void)
+{
+    pthread_kill(egress_tid, SIGUSR2);
+}
+
 /**
  * Handle the ingress traffic.
  * All ingress data is handled in a single pipeline until this point where
@@ -141,37 +170,36 @@ static void run_periodic_tasks(int delta_time)
  */
 static void * xstack_ingress_thread(void * arg)
 {
-    static uint8_t rx_buffer[ETHER_MAXLEN];
-
     while (1) {
-        struct ether_hdr hdr;
-        int retval;
+        struct ether_frame frames[XSTACK_ETHER_RX_BURST];
+        int n;
 
         LOG(LOG_DEBUG, "Waiting for rx");
 
-        retval = ether_receive(ether_handle, &hdr, rx_buffer,
-                               sizeof(rx_buffer));
-        if (retval == -1) {
+        n = ether_receive_burst(ether_handle, frames, num_elem(frames));
+        if (n == -1) {
             LOG(LOG_ERR, "Rx failed: %d", errno);
-        } else if (retval > 0) {
+        }
+        for (int i = 0; i < n; i++) {
+            struct ether_frame * frame = &frames[i];
+            int retval;
+
             LOG(LOG_DEBUG, "Frame received!");
 
-            retval = ether_input(&hdr, rx_buffer, retval);
+            retval = ether_input(frame);
             if (retval == -1) {
                 LOG(LOG_ERR, "Protocol handling failed: %d", errno);
             } else if (retval > 0) {
-                retval = ether_output_reply(ether_handle, &hdr, rx_buffer,
-                                            retval);
+                retval = ether_output_reply(ether_handle, &frame->hdr,
+                                            frame->payload, retval);
                 if (retval < 0) {
                     LOG(LOG_ERR, "Reply failed: %d", errno);
                 }
             }
         }
+        ether_tx_flush(ether_handle);
 
-        if (eval_timer()) {
-            LOG(LOG_DEBUG, "tick");
-            run_periodic_tasks(delta_time);
-        }
+        timer_run(UINT_MAX);
 
         if (get_state() == XSTACK_DYING) {
             break;
@@ -181,6 +209,52 @@ static void * xstack_ingress_thread(void * arg)
     pthread_exit(NULL);
 }
 
+static int egress_pending(void)
+{
+    for (size_t i = 0; i < num_elem(sockets); i++) {
+        if (!queue_isempty(sockets[i].egress_q)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Wait for egress datagrams or a timer.
+ * The egress thread serves all sockets, so instead of a futex it parks on
+ * the doorbell of every socket and sleeps waiting for SIGUSR2, which the
+ * ends only send if they see the thread parked.
+ */
+static void egress_wait(const sigset_t * sigset, unsigned timeout_ms)
+{
+    const struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000,
+    };
+
+    if (timeout_ms == 0) {
+        return;
+    }
+
+    for (unsigned spin = 0; spin < XSTACK_SOCK_SPIN_COUNT; spin++) {
+        if (egress_pending()) {
+            return;
+        }
+        cpu_relax();
+    }
+
+    for (size_t i = 0; i < num_elem(sockets); i++) {
+        doorbell_park(&sockets[i].ctrl->egress_bell);
+    }
+    if (!egress_pending()) {
+        sigtimedwait(sigset, NULL, &timeout);
+    }
+    for (size_t i = 0; i < num_elem(sockets); i++) {
+        doorbell_unpark(&sockets[i].ctrl->egress_bell);
+    }
+}
+
 /**
  * Handle the egress traffic.
  * All egress traffic is mux'd and serialized through one egress pipe.
@@ -199,39 +273,43 @@ static void * xstack_egress_thread(void * arg)
     }
 
     while (1) {
-        struct timespec timeout = {
-            .tv_sec = XSTACK_PERIODIC_EVENT_SEC,
-            .tv_nsec = 0,
-        };
-
-        sigtimedwait(&sigset, NULL, &timeout);
+        egress_wait(&sigset, timer_run(XSTACK_PERIODIC_EVENT_SEC * 1000));
 
         for (size_t i = 0; i < num_elem(sockets); i++) {
             struct xstack_sock * sock = sockets + i;
-
-            if (!queue_isempty(sock->egress_q)) {
-                int dgram_index;
-                struct xstack_dgram * dgram;
-                enum xstack_sock_proto proto;
-
-                while (!queue_peek(sock->egress_q, &dgram_index));
-                dgram = (struct xstack_dgram *)(sock->egress_data +
-                                                dgram_index);
-
-                LOG(LOG_DEBUG, "Sending a datagram");
-                proto = sock->info.sock_proto;
-                if (proto > XIP_PROTO_NONE &&
-                    proto < XIP_PROTO_LAST) {
-                    if (proto_send[proto](sock, dgram) < 0) {
-                        LOG(LOG_ERR, "Failed to send a datagram");
+            int dgram_index[XSTACK_SOCK_EGRESS_BURST];
+            size_t n;
+
+            /*
+             * Drain the whole queue in bursts, the frames are flushed at
+             * once.
+             */
+            while ((n = queue_rec_peek_bulk(sock->egress_q,
+                                            sock->egress_data, dgram_index,
+                                            num_elem(dgram_index)))) {
+                for (size_t j = 0; j < n; j++) {
+                    struct xstack_dgram * dgram;
+                    enum xstack_sock_proto proto;
+
+                    dgram = (struct xstack_dgram *)(sock->egress_data +
+                                                    dgram_index[j]);
+
+                    LOG(LOG_DEBUG, "Sending a datagram");
+                    proto = sock->info.sock_proto;
+                    if (proto > XIP_PROTO_NONE &&
+                        proto < XIP_PROTO_LAST) {
+                        if (proto_send[proto](sock, dgram) < 0) {
+                            LOG(LOG_ERR, "Failed to send a datagram");
+                        }
+                    } else {
+                        LOG(LOG_ERR, "Invalid protocol");
                     }
-                } else {
-                    LOG(LOG_ERR, "Invalid protocol");
                 }
 
-                queue_discard(sock->egress_q, 1);
+                queue_rec_discard(sock->egress_q, sock->egress_data, n);
             }
         }
+        ether_tx_flush(ether_handle);
 
         if (get_state() == XSTACK_DYING) {
             break;
@@ -247,38 +325,57 @@ static void xstack_init(void)
 
     for (size_t i = 0; i < num_elem(sockets); i++) {
         struct xstack_sock * sock = sockets + i;
+        size_t ring_size;
+        size_t shmem_size;
+        struct stat st;
         int fd;
         void * pa;
 
+        if (sock->ring_size == 0) {
+            sock->ring_size = XSTACK_DATAGRAM_BUF_SIZE;
+        }
+        ring_size = sock->ring_size;
+        if ((ring_size & (ring_size - 1)) || ring_size < XSTACK_SOCK_RING_MIN) {
+            fprintf(stderr, "Invalid ring size for %s\n", sock->shmem_path);
+            exit(1);
+        }
+        shmem_size = XSTACK_SHMEM_SIZE(ring_size);
+
         fd = open(sock->shmem_path, O_RDWR);
         if (fd == -1) {
             perror("Failed to open shmem file");
             exit(1);
         }
 
-        pa = mmap(0, XSTACK_SHMEM_SIZE, PROT_READ | PROT_WRITE,
+        if (fstat(fd, &st) == -1 ||
+            ((size_t)st.st_size < shmem_size && ftruncate(fd, shmem_size))) {
+            perror("Failed to size the shmem file");
+            exit(1);
+        }
+
+        pa = mmap(0, shmem_size, PROT_READ | PROT_WRITE,
                   MAP_SHARED, fd, 0);
         if (pa == MAP_FAILED) {
             perror("Failed to mmap() shared mem");
             exit(1);
         }
-        memset(pa, 0, XSTACK_SHMEM_SIZE);
+        close(fd);
+        memset(pa, 0, shmem_size);
 
         sock->ctrl = XSTACK_SOCK_CTRL(pa);
         *sock->ctrl = (struct xstack_sock_ctrl){
             .pid_inetd = mypid,
             .pid_end = 0,
+            .ring_size = ring_size,
         };
 
         sock->ingress_data = XSTACK_INGRESS_DADDR(pa);
         sock->ingress_q = XSTACK_INGRESS_QADDR(pa);
-        *sock->ingress_q = queue_create(XSTACK_DATAGRAM_SIZE_MAX,
-                                        XSTACK_DATAGRAM_BUF_SIZE);
+        *sock->ingress_q = queue_create(XSTACK_SOCK_RING_GRANULE, ring_size);
 
         sock->egress_data = XSTACK_EGRESS_DADDR(pa);
         sock->egress_q = XSTACK_EGRESS_QADDR(pa);
-        *sock->egress_q = queue_create(XSTACK_DATAGRAM_SIZE_MAX,
-                                       XSTACK_DATAGRAM_BUF_SIZE);
+        *sock->egress_q = queue_create(XSTACK_SOCK_RING_GRANULE, ring_size);
 
         if (xstack_bind(sock) < 0) {
             perror("Failed to bind a socket");
@@ -306,6 +403,10 @@ int xstack_start(int handle)
         pthread_cancel(ingress_tid);
         return -1;
     }
+    timer_set_wakeup(timer_wakeup_egress);
+
+    timer_init(&periodic_timer, periodic_timer_fn);
+    timer_arm(&periodic_timer, 0);
 
     set_state(XSTACK_RUNNING);
     return 0;
@@ -314,6 +415,7 @@ int xstack_start(int handle)
 void xstack_stop(void)
 {
     set_state(XSTACK_DYING);
+    timer_cancel(&periodic_timer);
 
     pthread_join(ingress_tid, NULL);
     pthread_join(egress_tid, NULL);
@@ -323,34 +425,53 @@ void xstack_stop(void)
 
 int main(int argc, char * argv[])
 {
-    char * const ether_args[] = {
-        argv[1],
-        NULL,
-    };
-    int handle;
+    const char * driver = NULL;
+    in_addr_t gw = 0;
+    int opt, handle;
     sigset_t sigset;
 
-    if (argc == 1) {
-        fprintf(stderr, "Usage: %s INTERFACE\n", argv[0]);
-        exit(1);
+    while ((opt = getopt(argc, argv, "d:g:")) != -1) {
+        struct in_addr addr;
+
+        switch (opt) {
+        case 'd':
+            driver = optarg;
+            break;
+        case 'g':
+            if (inet_pton(AF_INET, optarg, &addr) != 1) {
+                goto usage;
+            }
+            gw = ntohl(addr.s_addr);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind >= argc) {
+        goto usage;
     }
 
     toggle_dbgmsg("src/tcp.c");
     toggle_dbgmsg("src/ether.c");
 
+    /*
+     * Block SIGUSR2 for all future threads, it's only waited for by the
+     * egress thread and would otherwise kill the process if delivered to
+     * any other thread.
+     */
     sigemptyset(&sigset);
     sigaddset(&sigset, SIGUSR1);
-
-    /* Block sigset for all future threads */
+    sigaddset(&sigset, SIGUSR2);
     sigprocmask(SIG_SETMASK, &sigset, NULL);
+    sigdelset(&sigset, SIGUSR2);
 
-    handle = ether_init(ether_args);
+    handle = ether_init(driver, argv + optind);
     if (handle == -1) {
         perror("Failed to init");
         exit(1);
     }
 
-    if (ip_config(handle, 167772162, 4294967040)) {
+    if (ip_config(handle, 167772162, 4294967040, gw)) {
         perror("Failed to config IP");
         exit(1);
     }
@@ -366,4 +487,9 @@ int main(int argc, char * argv[])
     ether_deinit(handle);
 
     return 0;
+usage:
+    fprintf(stderr,
+            "Usage: %s [-d DRIVER] [-g GATEWAY] INTERFACE [OPTION=VALUE]...\n",
+            argv[0]);
+    exit(1);
 }
@@ -51,6 +51,7 @@ struct arp_ip {
  * ARP Cache entry type.
  */
 enum arp_cache_entry_type {
+    ARP_CACHE_INCOMPLETE = -3, /*!< Waiting for a reply, internal to ARP. */
     ARP_CACHE_FREE = -2,    /*!< Unused entry. */
     ARP_CACHE_STATIC = -1,  /*!< Static entry. */
     ARP_CACHE_DYN = 0,      /*!< Dynamic entry. */
@@ -59,8 +60,27 @@ enum arp_cache_entry_type {
 int arp_cache_insert(in_addr_t ip_addr, const mac_addr_t ether_addr,
                      enum arp_cache_entry_type type);
 void arp_cache_remove(in_addr_t ip_addr);
+/**
+ * Get the link address of ip_addr.
+ * If the address isn't in the cache a resolution is started. Only one
+ * resolution is in progress per address and the requests are retransmitted
+ * with a backoff.
+ * @param iface is the local address used as the source of the requests.
+ * @retval 0 haddr is set;
+ * @retval -1 the address isn't resolved, errno is set to EHOSTUNREACH if the
+ *            resolution is in progress or EHOSTDOWN if it failed.
+ */
 int arp_cache_get_haddr(in_addr_t iface, in_addr_t ip_addr, mac_addr_t haddr);
 
+/**
+ * Get the current generation of the ARP cache.
+ * The generation changes whenever an existing mapping is changed or removed,
+ * and when an entry enters the probe window before its expiration so that
+ * addresses cached elsewhere are looked up again and ARP sees whether the
+ * entry is still in use.
+ */
+unsigned arp_cache_generation(void);
+
 /**
  * @}
  */
@@ -34,6 +34,22 @@
  * @}
  */
 
+/**
+ * Length of the FCS appended to transmitted frames by software.
+ */
+#if XSTACK_ETHER_SW_FCS
+#define ETHER_TX_FCS_LEN        ETHER_FCS_LEN
+#else
+#define ETHER_TX_FCS_LEN           0
+#endif
+
+/**
+ * Minimum writable size of a received payload buffer.
+ * Input handlers build replies in place and a reply to a short frame can be
+ * longer than the frame itself, e.g. an ICMP error quoting the IP header.
+ */
+#define ETHER_RX_BUF_MIN         128
+
 /**
  * Protocol type IDs.
  * @{
@@ -58,9 +74,25 @@ struct ether_hdr {
     uint16_t h_proto; /*!< Packet type ID */
 } __attribute__((packed));
 
+/**
+ * A received ethernet frame.
+ */
+struct ether_frame {
+    struct ether_hdr hdr;   /*!< Frame header in host byte order. */
+    uint8_t * payload;      /*!< Pointer to the payload of the frame. */
+    size_t bsize;           /*!< Size of the payload. */
+    unsigned flags;         /*!< ETHER_FRAME_ flags. */
+};
+
+/**
+ * Checksums of the frame were verified by the NIC or the kernel.
+ */
+#define ETHER_FRAME_CSUM_VALID  0x1
+
 struct _ether_proto_handler {
     uint16_t proto_id;
-    int (*fn)(const struct ether_hdr * hdr, uint8_t * payload, size_t bsize);
+    int (*fn)(const struct ether_hdr * hdr, uint8_t * payload, size_t bsize,
+              unsigned flags);
 };
 
 /**
@@ -74,13 +106,54 @@ struct _ether_proto_handler {
     DATA_SET(_ether_proto_handlers, _ether_proto_handler_##_handler_fn_)
 
 
+/**
+ * Ether driver.
+ * A driver implements the raw RX and TX functions for a link and
+ * registers itself with ETHER_DRIVER(). The handle passed to the
+ * functions is the driver's own handle returned by init().
+ */
+struct ether_driver {
+    const char * name;
+    int (*init)(char * const args[]);
+    void (*deinit)(int handle);
+    int (*handle2addr)(int handle, mac_addr_t addr);
+    int (*receive_burst)(int handle, struct ether_frame * frames, size_t nr);
+    uint8_t * (*tx_alloc)(int handle);
+    int (*tx_commit)(int handle, const mac_addr_t dst, uint16_t proto,
+                     size_t bsize);
+    void (*tx_abort)(int handle);
+    int (*tx_flush)(int handle);
+    int (*add_inet4_addr)(int handle, uint32_t addr, uint32_t netmask);
+};
+
+/**
+ * Declare an ether driver.
+ */
+#define ETHER_DRIVER(_driver_) \
+    DATA_SET(_ether_drivers, _driver_)
+
+/**
+ * Get the value of a driver option.
+ * @returns a pointer to the value if opt is of the form "name=value";
+ *          Otherwise NULL.
+ */
+const char * ether_opt_value(const char * opt, const char * name);
+
 const mac_addr_t mac_broadcast_addr;
 
-int ether_init(char * const args[]);
+/**
+ * Initialize a link.
+ * @param driver is the name of the ether driver or NULL for the default
+ *               driver.
+ * @param args is a NULL terminated list of driver arguments; the first one
+ *             is the interface name and the rest are driver options.
+ * @returns an ether handle; -1 if an error occured, errno is set.
+ */
+int ether_init(const char * driver, char * const args[]);
 void ether_deinit(int ether_handle);
 uint32_t ether_fcs(const void * data, size_t bsize);
 
-/* Platform dependent functions */
+/* Driver dependent functions */
 
 /**
  * Get the MAC address of an interface.
@@ -94,6 +167,16 @@ int ether_handle2addr(int handle, mac_addr_t addr);
  */
 int ether_addr2handle(const mac_addr_t addr);
 
+/**
+ * Tell the driver about an IPv4 address configured on the link.
+ * A driver may use this to filter out unrelated frames before they are
+ * received.
+ * @param addr is the address in host byte order.
+ * @param netmask is the netmask in host byte order.
+ * @returns 0 if succeed; a negative errno if an error occured.
+ */
+int ether_add_inet4_addr(int handle, uint32_t addr, uint32_t netmask);
+
 /**
  * Raw Ethernet RX and TX functions.
  * @{
@@ -107,11 +190,56 @@ int ether_addr2handle(const mac_addr_t addr);
  */
 int ether_receive(int handle, struct ether_hdr * hdr, uint8_t * buf,
                   size_t bsize);
+/**
+ * Receive a burst of frames from ether without copying them.
+ * The payloads are lent to the caller until the next receive call on the
+ * same handle. Each lent buffer is writable and at least
+ * max(bsize, ETHER_RX_BUF_MIN) bytes long.
+ * @param[out] frames is filled with the received frames.
+ * @param nr is the max number of frames to receive; a driver may receive
+ *           at most XSTACK_ETHER_RX_BURST frames at once.
+ * @retval >0 the number of frames received;
+ * @retval  0 read timed out;
+ * @retval -1 an read error occured, errno is set.
+ */
+int ether_receive_burst(int handle, struct ether_frame * frames, size_t nr);
 /**
  * Send a frame to a destionation over ether.
+ * The frame is copied to a transmit buffer and sent immediately.
  */
 int ether_send(int handle, const mac_addr_t dst, uint16_t proto,
                uint8_t * buf, size_t bsize);
+
+/**
+ * Reserve a transmit buffer.
+ * The buffer stays reserved until ether_tx_commit() or ether_tx_abort() is
+ * called and any other transmission on the same handle blocks meanwhile.
+ * @returns a pointer to ETHER_DATA_LEN bytes of payload space;
+ *          NULL if no buffer is available, errno is set.
+ */
+uint8_t * ether_tx_alloc(int handle);
+
+/**
+ * Queue the frame reserved with ether_tx_alloc() for transmission.
+ * The frame is released whether the call succeeds or not, but it's not
+ * necessarily sent before ether_tx_flush() is called.
+ * @param bsize is the number of payload bytes written to the buffer.
+ * @returns the size of the frame;
+ *          a negative errno if an error occured.
+ */
+int ether_tx_commit(int handle, const mac_addr_t dst, uint16_t proto,
+                    size_t bsize);
+
+/**
+ * Release the buffer reserved with ether_tx_alloc() without sending it.
+ */
+void ether_tx_abort(int handle);
+
+/**
+ * Send all frames queued with ether_tx_commit().
+ * @returns 0 or a negative errno.
+ */
+int ether_tx_flush(int handle);
 /**
  * @}
  */
@@ -123,14 +251,15 @@ int ether_send(int handle, const mac_addr_t dst, uint16_t proto,
 
 /**
  * Handle the received ethernet frame.
- * @retval >0 the size of the reply written back to payload;
+ * @retval >0 the size of the reply written back to the frame payload;
  * @retval  0 if no reply should be sent;
  * @retval -1 an error occured, errno is set.
  */
-int ether_input(const struct ether_hdr * hdr, uint8_t * payload, size_t bsize);
+int ether_input(const struct ether_frame * frame);
 
 /**
  * Send back a reply message.
+ * The reply is queued and sent on the next ether_tx_flush().
  * @param hdr must be untouched header received by ether_receive().
  */
 int ether_output_reply(int ether_handle, const struct ether_hdr * hdr,
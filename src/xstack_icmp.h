@@ -49,6 +49,7 @@ struct icmp_destunreac {
 #define ICMP_CODE_HOSTUNREAC    1 /*!< Host unreachable error. */
 #define ICMP_CODE_PROTOUNREAC   2 /*!< Protocol unreachable error. */
 #define ICMP_CODE_PORTUNREAC    3 /*!< Port unreachable error. */
+#define ICMP_CODE_FRAGNEEDED    4 /*!< Fragmentation needed and DF set. */
 #define ICMP_CODE_DESTNETUNK    6 /*!< Destination network unknown error. */
 #define ICMP_CODE_HOSTUNK       7 /*!< Destination host unknown error. */
 /**
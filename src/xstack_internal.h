@@ -37,6 +37,7 @@ struct xstack_sock {
         } udp;
     } data;
     char shmem_path[80];
+    size_t ring_size; /*!< Ring size or 0 for XSTACK_DATAGRAM_BUF_SIZE. */
 };
 
 /**
@@ -47,6 +48,8 @@ struct xstack_sock {
 /**
  * Handle socket input data.
  * Transport -> Socket
+ * @returns 0 if the datagram was queued to the socket;
+ *          -EMSGSIZE if the datagram doesn't fit in the socket ring.
  */
 int xstack_sock_dgram_input(struct xstack_sock * sock,
                             struct xstack_sockaddr * srcaddr,
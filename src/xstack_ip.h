@@ -7,6 +7,8 @@
 #ifndef XSTACK_IP_H
 #define XSTACK_IP_H
 
+#include <sys/uio.h>
+
 #include "xstack_ether.h"
 #include "xstack_in.h"
 #include "linker_set.h"
@@ -65,7 +67,7 @@ struct ip_hdr {
 #define IP_VERSION(_ip_hdr_) \
     (((ip_hdr)->ip_vhl & 0x40) >> 4)
 
-#define IP_FALGS_DF 0x4000
+#define IP_FLAGS_DF 0x4000
 #define IP_FLAGS_MF 0x2000
 
 /**
@@ -105,7 +107,14 @@ struct _ip_proto_handler {
     };                                                                      \
     DATA_SET(_ip_proto_handlers, _ip_proto_handler_##_handler_fn_)
 
-int ip_config(int ether_handle, in_addr_t ip_addr, in_addr_t netmask);
+/**
+ * Configure an IP address for an interface.
+ * @param gw is the default gateway reachable through the interface or 0 if
+ *           no default route should be added.
+ * @returns 0 if succeed; -1 if failed, errno is set.
+ */
+int ip_config(int ether_handle, in_addr_t ip_addr, in_addr_t netmask,
+              in_addr_t gw);
 
 /**
  * IP Packet manipulation.
@@ -117,6 +126,56 @@ int ip_config(int ether_handle, in_addr_t ip_addr, in_addr_t netmask);
  */
 uint16_t ip_checksum(void * dp, size_t bsize);
 
+/**
+ * Internet checksum building blocks.
+ * A partial sum can be continued over multiple buffers as long as all but
+ * the last buffer are of even length. The final sum is folded into a
+ * checksum with ip_checksum_fold().
+ * @{
+ */
+
+/**
+ * Add bsize bytes of data to a partial checksum.
+ */
+uint32_t ip_checksum_partial(const void * dp, size_t bsize, uint32_t sum);
+
+/**
+ * Copy bsize bytes from src to dst and add them to a partial checksum.
+ */
+uint32_t ip_checksum_copy(void * dst, const void * src, size_t bsize,
+                          uint32_t sum);
+
+/**
+ * Calculate the partial checksum of an IPv4 pseudo header.
+ * @param src is the source address in host byte order.
+ * @param dst is the destination address in host byte order.
+ * @param bsize is the size of the transport header and data.
+ */
+uint32_t ip_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t proto,
+                            uint16_t bsize);
+
+/**
+ * Fold a partial checksum into the final checksum.
+ */
+uint16_t ip_checksum_fold(uint32_t sum);
+
+/**
+ * Update a checksum after a part of the checksummed data has changed.
+ * Implements the incremental update of RFC 1624.
+ * @param csum is the old checksum.
+ * @param old is the old data.
+ * @param new is the new data.
+ * @param bsize is the size of the changed data; must be even and the data
+ *              must start at an even offset of the checksummed data.
+ * @returns the new checksum.
+ */
+uint16_t ip_checksum_adjust(uint16_t csum, const void * old, const void * new,
+                            size_t bsize);
+
+/**
+ * @}
+ */
+
 /**
  * Get the header length of an IP packet.
  */
@@ -136,8 +195,11 @@ static inline size_t ip_hdr_hlen(const struct ip_hdr * ip)
 
 /**
  * Update a route.
+ * A route is identified by its network address and mask.
  * @param[in] route is a pointer to a route struct; the information will be
  *                  copied from the struct.
+ * @returns 0 if succeed; -1 if the netmask is not contiguous or out of
+ *          memory, errno is set.
  */
 int ip_route_update(struct ip_route * route);
 
@@ -148,11 +210,18 @@ int ip_route_remove(struct ip_route * route);
 
 /**
  * Get routing information for a network.
+ * The most specific route containing the address is selected.
  * @param[out] route    is a pointer to a ip_route struct that will be updated
  *                      if a route is found.
  */
 int ip_route_find_by_network(in_addr_t ip, struct ip_route * route);
 
+/**
+ * Get the current generation of the routing table.
+ * The generation changes whenever a route is updated or removed.
+ */
+unsigned ip_route_generation(void);
+
 /**
  * Get routing information for a source IP addess.
  * The function can be also used for source IP address validation by setting
@@ -170,15 +239,33 @@ int ip_route_find_by_iface(in_addr_t addr, struct ip_route * route);
  */
 void ip_hton(const struct ip_hdr * host, struct ip_hdr * net);
 size_t ip_ntoh(const struct ip_hdr * net, struct ip_hdr * host);
+/**
+ * Convert an IP header to host order and verify its checksum in one pass.
+ * The header can be converted in place.
+ * @param net is a pointer to the header in network order, at least
+ *            ip_hdr_hlen() bytes must be readable.
+ * @retval 0 the checksum is valid;
+ * @retval -1 the checksum is invalid, the header is converted anyway.
+ */
+int ip_ntoh_verify(const struct ip_hdr * net, struct ip_hdr * host);
 
-int ip_input(const struct ether_hdr * e_hdr, uint8_t * payload, size_t bsize);
+/**
+ * IP input chain.
+ * @param e_hdr is the ethernet header of the frame or NULL if the packet was
+ *              reassembled locally and it's already in host order.
+ * @param flags are the ETHER_FRAME_ flags of the frame.
+ */
+int ip_input(const struct ether_hdr * e_hdr, uint8_t * payload, size_t bsize,
+             unsigned flags);
 
 /**
  * Construct a reply header from a received IP packet header.
  * Swaps src and dst etc.
+ * The checksum is updated incrementally so the header must be unmodified
+ * apart from the fields changed by this function.
  * @param host_ip_hd is a pointer to a IP packet header that should be reversed.
  * @param bsize is the size of the packet data.
- * @returns Returns the size of the header.
+ * @returns Returns the size of the reply packet.
  */
 size_t ip_reply_header(struct ip_hdr * host_ip_hdr, size_t bsize);
 /**
@@ -190,6 +277,13 @@ size_t ip_reply_header(struct ip_hdr * host_ip_hdr, size_t bsize);
  */
 int ip_send(in_addr_t dst, uint8_t proto, const uint8_t * buf, size_t bsize);
 
+/**
+ * Send an IP packet gathered from several buffers to a destination.
+ * The data is copied directly to the transmit buffers of the link.
+ */
+int ip_sendv(in_addr_t dst, uint8_t proto, const struct iovec * iov,
+             int iovcnt);
+
 /**
  * IP Fragmentation
  * @{
@@ -0,0 +1,93 @@
+/*
+ * Receive side benchmark for libxstack.
+ * Counts datagrams received from the unetcat socket, use udp.c to send them.
+ * Pass -s to receive with xstack_recvfrom() or -z to borrow the datagrams
+ * with xstack_recv_borrow() instead of using xstack_recvmmsg().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xstack_socket.h"
+#include "xstack_util.h"
+
+#define BURST 32
+
+static char buf[BURST][2048];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char * argv[])
+{
+    struct xstack_mmsghdr msgs[BURST];
+    const int single = (argc > 1 && !strcmp(argv[1], "-s"));
+    const int borrow = (argc > 1 && !strcmp(argv[1], "-z"));
+    unsigned long long count = 0, bytes = 0;
+    double start;
+    void * sock;
+
+    sock = xstack_listen("/tmp/unetcat.sock");
+    if (!sock) {
+        perror("Failed to open sock");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < num_elem(msgs); i++) {
+        msgs[i] = (struct xstack_mmsghdr){
+            .msg_buf = buf[i],
+            .msg_buflen = sizeof(buf[i]),
+        };
+    }
+
+    start = now();
+    while (1) {
+        double t;
+
+        if (single) {
+            ssize_t r = xstack_recvfrom(sock, buf[0], sizeof(buf[0]), 0, NULL);
+
+            if (r >= 0) {
+                count++;
+                bytes += r;
+            }
+        } else if (borrow) {
+            int n = xstack_recv_borrow(sock, msgs, num_elem(msgs));
+
+            for (int i = 0; i < n; i++) {
+                bytes += msgs[i].msg_len;
+            }
+            if (n > 0) {
+                count += n;
+                xstack_recv_release(sock, n);
+            }
+        } else {
+            int n = xstack_recvmmsg(sock, msgs, num_elem(msgs), 0);
+
+            for (int i = 0; i < n; i++) {
+                bytes += msgs[i].msg_len;
+            }
+            if (n > 0) {
+                count += n;
+            }
+        }
+
+        t = now();
+        if (t - start >= 1.0) {
+            printf("%.0f dgram/s %.2f MB/s\n",
+                   count / (t - start), bytes / (t - start) / 1e6);
+            fflush(stdout);
+            count = 0;
+            bytes = 0;
+            start = t;
+        }
+    }
+}
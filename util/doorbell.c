@@ -0,0 +1,58 @@
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "doorbell.h"
+
+/*
+ * Parking and publishing are ordered against the queue index accesses with
+ * full barriers. Either the producer sees the consumer parked or the consumer
+ * sees the new data when it rechecks the queue after parking.
+ */
+
+static int futex(doorbell_t * uaddr, int op, uint32_t val,
+                 const struct timespec * timeout)
+{
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+void doorbell_park(doorbell_t * bell)
+{
+    __atomic_store_n(bell, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void doorbell_unpark(doorbell_t * bell)
+{
+    __atomic_store_n(bell, 0, __ATOMIC_RELAXED);
+}
+
+int doorbell_wait(doorbell_t * bell, const struct timespec * timeout)
+{
+    /* The doorbell is shared between processes so no FUTEX_PRIVATE_FLAG. */
+    if (futex(bell, FUTEX_WAIT, 1, timeout) == -1 && errno != EAGAIN) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int doorbell_clear(doorbell_t * bell)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    /* Avoid dirtying the consumer's cache line if it's not parked. */
+    if (!__atomic_load_n(bell, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    return __atomic_exchange_n(bell, 0, __ATOMIC_SEQ_CST) != 0;
+}
+
+void doorbell_ring(doorbell_t * bell)
+{
+    if (doorbell_clear(bell)) {
+        futex(bell, FUTEX_WAKE, 1, NULL);
+    }
+}
@@ -37,85 +37,190 @@
 
 #include "queue_r.h"
 
+/*
+ * The write index is published with a release store after the data has been
+ * written and the read index after the data has been consumed, so an acquire
+ * load of the opposite index guarantees that the slots it covers are safe to
+ * access.
+ */
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/**
+ * Record header.
+ */
+struct queue_rec {
+    uint32_t len;   /*!< Length of the record in blocks including the header. */
+    uint32_t flags;
+};
+
+#define QUEUE_REC_WRAP 0x1 /*!< Skip to the beginning of the array. */
+
+_Static_assert(sizeof(struct queue_rec) == QUEUE_REC_HDR_SIZE,
+               "QUEUE_REC_HDR_SIZE mismatch");
+
 queue_cb_t queue_create(size_t block_size, size_t array_size)
 {
-    queue_cb_t cb = {
-        .b_size = block_size,
-        .a_len = array_size / block_size,
-        .m_read = 0,
-        .m_write = 0
-    };
+    size_t len = array_size / block_size;
+    queue_cb_t cb;
+
+    /* Round down to a power of two. */
+    while (len & (len - 1)) {
+        len &= len - 1;
+    }
+
+    memset(&cb, 0, sizeof(cb));
+    cb.b_size = block_size;
+    cb.a_len = len;
 
     return cb;
 }
 
-int queue_alloc(queue_cb_t * cb)
+static inline int queue_offset(const queue_cb_t * cb, size_t i)
 {
-    const size_t write = cb->m_write;
-    const size_t next_element = (write + 1) % cb->a_len;
-    const size_t b_size = cb->b_size;
-
-    /* Check that the queue is not full */
-    if (next_element == cb->m_read)
-        return -1;
-
-    return write * b_size;
+    return (int)((i & (cb->a_len - 1)) * cb->b_size);
 }
 
-void queue_commit(queue_cb_t * cb)
+/**
+ * Get the number of free slots after write as seen by the push end.
+ */
+static size_t queue_free(queue_cb_t * cb, size_t write, size_t want)
 {
-    const size_t next_element = (cb->m_write + 1) % cb->a_len;
+    size_t free = cb->a_len - (write - cb->m_read_cache);
 
-    cb->m_write = next_element;
+    if (free < want) {
+        cb->m_read_cache = load_acquire(&cb->m_read);
+        free = cb->a_len - (write - cb->m_read_cache);
+    }
+
+    return free;
 }
 
-int queue_peek(queue_cb_t * cb, int * index)
+/**
+ * Get the number of used slots as seen by the pop end.
+ */
+static size_t queue_used(queue_cb_t * cb, size_t want)
 {
     const size_t read = cb->m_read;
-    const size_t b_size = cb->b_size;
+    size_t used = cb->m_write_cache - read;
 
-    /* Check that the queue is not empty */
-    if (read == cb->m_write)
-        return 0;
+    if (used < want) {
+        cb->m_write_cache = load_acquire(&cb->m_write);
+        used = cb->m_write_cache - read;
+    }
 
-    *index = read * b_size;
+    return used;
+}
 
-    return 1;
+static inline struct queue_rec * queue_rec_hdr(const queue_cb_t * cb,
+                                               uint8_t * data, size_t i)
+{
+    return (struct queue_rec *)(data + queue_offset(cb, i));
 }
 
-int queue_discard(queue_cb_t * cb, size_t n)
+int queue_rec_alloc(queue_cb_t * cb, uint8_t * data, size_t size)
 {
-    size_t count;
+    const size_t b_size = cb->b_size;
+    const size_t len = (QUEUE_REC_HDR_SIZE + size + b_size - 1) / b_size;
+    size_t pend = cb->m_pend;
+    const size_t contig = cb->a_len - (pend & (cb->a_len - 1));
+    const size_t skip = (len > contig) ? contig : 0;
+    struct queue_rec * rec;
 
-    for (count = 0; count < n; count++) {
-        const size_t read = cb->m_read;
+    if (queue_free(cb, pend, skip + len) < skip + len)
+        return -1;
+
+    if (skip) {
+        rec = queue_rec_hdr(cb, data, pend);
+        rec->len = skip;
+        rec->flags = QUEUE_REC_WRAP;
+        pend += skip;
+    }
+
+    rec = queue_rec_hdr(cb, data, pend);
+    rec->len = len;
+    rec->flags = 0;
+    cb->m_pend = pend + len;
+
+    return queue_offset(cb, pend) + QUEUE_REC_HDR_SIZE;
+}
 
-        /* Check that the queue is not empty */
-        if (read == cb->m_write)
-            break;
+void queue_rec_commit(queue_cb_t * cb)
+{
+    store_release(&cb->m_write, cb->m_pend);
+}
 
-        cb->m_read = (read + 1) % cb->a_len;
+/**
+ * Walk over up to n records starting from the read end.
+ * @param[out] index is set to the record locations if not NULL.
+ * @param[out] end is set to the index following the last record.
+ * @returns the number of records found.
+ */
+static size_t queue_rec_walk(queue_cb_t * cb, uint8_t * data, int * index,
+                             size_t n, size_t * end)
+{
+    const size_t read = cb->m_read;
+    size_t i = read;
+    size_t count = 0;
+
+    while (count < n && i - read < queue_used(cb, i - read + 1)) {
+        const struct queue_rec * rec = queue_rec_hdr(cb, data, i);
+
+        if (!(rec->flags & QUEUE_REC_WRAP)) {
+            if (index)
+                index[count] = queue_offset(cb, i) + QUEUE_REC_HDR_SIZE;
+            count++;
+        }
+        i += rec->len;
     }
+    *end = i;
 
     return count;
 }
 
+int queue_rec_peek(queue_cb_t * cb, uint8_t * data, int * index)
+{
+    return (int)queue_rec_peek_bulk(cb, data, index, 1);
+}
+
+size_t queue_rec_peek_bulk(queue_cb_t * cb, uint8_t * data, int * index,
+                           size_t n)
+{
+    size_t end;
+
+    return queue_rec_walk(cb, data, index, n, &end);
+}
+
+int queue_rec_discard(queue_cb_t * cb, uint8_t * data, size_t n)
+{
+    size_t end;
+
+    n = queue_rec_walk(cb, data, NULL, n, &end);
+    store_release(&cb->m_read, end);
+
+    return n;
+}
+
 void queue_clear_from_push_end(queue_cb_t * cb)
 {
-    cb->m_write = cb->m_read;
+    cb->m_read_cache = load_acquire(&cb->m_read);
+    cb->m_pend = cb->m_read_cache;
+    store_release(&cb->m_write, cb->m_read_cache);
 }
 
 void queue_clear_from_pop_end(queue_cb_t * cb)
 {
-    cb->m_read = cb->m_write;
+    cb->m_write_cache = load_acquire(&cb->m_write);
+    store_release(&cb->m_read, cb->m_write_cache);
 }
 
 int queue_isempty(queue_cb_t * cb)
 {
-    return (int)(cb->m_write == cb->m_read);
+    return (int)(load_acquire(&cb->m_write) == load_acquire(&cb->m_read));
 }
 
 int queue_isfull(queue_cb_t * cb)
 {
-    return (int)(((cb->m_write + 1) % cb->a_len) == cb->m_read);
+    return (int)(load_acquire(&cb->m_write) - load_acquire(&cb->m_read) ==
+                 cb->a_len);
 }